@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "json_writer.h"
+
+/*
+** C module addition to energenie code providing a bounded JSON writer for the strings returned to node.
+**
+** The writer appends at a cursor into the caller's buffer, so building a message is linear in its length (unlike
+** repeated strcat), and it never writes beyond the buffer: anything that does not fit sets 'truncated' and
+** json_end() returns JSON_ERR_TRUNCATED.  Numbers are formatted directly rather than through printf, giving the
+** same digits.
+**
+** Author: Phil Grainger - @Achronite
+*/
+
+static const unsigned int POW10[JSON_MAX_PLACES + 1] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+void json_init(struct JSON_WRITER *jw, char *buf, unsigned int size)
+{
+    jw->buf = buf;
+    jw->len = 0;
+    jw->size = size;
+    jw->truncated = (size == 0);
+}
+
+/*
+** json_raw() - append n characters, as they are
+**
+** Room is always left for the null terminator added by json_end()
+*/
+void json_raw(struct JSON_WRITER *jw, const char *str, unsigned int n)
+{
+    if (jw->truncated)
+        return;
+
+    if (n >= jw->size - jw->len)
+    {
+        // copy what fits
+        n = jw->size - jw->len - 1;
+        jw->truncated = true;
+    }
+    memcpy(jw->buf + jw->len, str, n);
+    jw->len += n;
+}
+
+void json_char(struct JSON_WRITER *jw, char c)
+{
+    if (jw->truncated)
+        return;
+
+    if (jw->len + 1 >= jw->size)
+        jw->truncated = true;
+    else
+        jw->buf[jw->len++] = c;
+}
+
+// digits of u, written backwards ending at end; returns the start
+static char *_json_digits(char *end, unsigned long long u)
+{
+    do
+    {
+        *--end = '0' + (u % 10);
+        u /= 10;
+    } while (u != 0);
+
+    return end;
+}
+
+void json_uint(struct JSON_WRITER *jw, unsigned long long u)
+{
+    char num[24];
+    char *start = _json_digits(num + sizeof(num), u);
+
+    json_raw(jw, start, num + sizeof(num) - start);
+}
+
+void json_int(struct JSON_WRITER *jw, long long i)
+{
+    char num[24];
+    char *start = _json_digits(num + sizeof(num), (i < 0) ? -(unsigned long long)i : (unsigned long long)i);
+
+    if (i < 0)
+        *--start = '-';
+    json_raw(jw, start, num + sizeof(num) - start);
+}
+
+/*
+** json_fixed() - append f with 'places' decimal places, as printf("%.*f") would
+**
+** A float has a 24 bit mantissa and 10^6 needs 20 bits, so scaling it into a double is exact and rounding that to
+** even gives the same digits as printf.  Anything outside that (or not finite) is left to printf.
+*/
+void json_fixed(struct JSON_WRITER *jw, float f, unsigned int places)
+{
+    char num[48];
+    char *start;
+    unsigned long long u;
+    unsigned int i;
+    int n;
+
+    if (places > JSON_MAX_PLACES || !isfinite(f) || fabsf(f) >= 1e12f)
+    {
+        n = snprintf(num, sizeof(num), "%.*f", (int)places, f);
+        if (n < 0 || (unsigned int)n >= sizeof(num))
+            jw->truncated = true;
+        else
+            json_raw(jw, num, n);
+        return;
+    }
+
+    u = (unsigned long long)nearbyint(fabs((double)f) * POW10[places]);
+    start = num + sizeof(num);
+    for (i = 0; i < places; i++)
+    {
+        *--start = '0' + (u % 10);
+        u /= 10;
+    }
+    if (places > 0)
+        *--start = '.';
+    start = _json_digits(start, u);
+    if (signbit(f))
+        *--start = '-';
+
+    json_raw(jw, start, num + sizeof(num) - start);
+}
+
+// append f as printf("%g") would, only used for the odd value so printf does it
+void json_general(struct JSON_WRITER *jw, float f)
+{
+    char num[32];
+    int n = snprintf(num, sizeof(num), "%g", f);
+
+    if (n < 0 || (unsigned int)n >= sizeof(num))
+        jw->truncated = true;
+    else
+        json_raw(jw, num, n);
+}
+
+void json_bool(struct JSON_WRITER *jw, bool b)
+{
+    if (b)
+        json_raw(jw, "true", 4);
+    else
+        json_raw(jw, "false", 5);
+}
+
+/*
+** json_str() - append str as a quoted JSON string
+**
+** Quotes, backslashes and control characters are escaped, as the strings can come from the radio
+*/
+void json_str(struct JSON_WRITER *jw, const char *str)
+{
+    static const char HEX[] = "0123456789abcdef";
+    const char *run = str;
+    char esc[6];
+    unsigned char c;
+
+    json_char(jw, '"');
+    for (; (c = (unsigned char)*str) != '\0'; str++)
+    {
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        // write the plain run before this character, then its escape
+        json_raw(jw, run, str - run);
+        run = str + 1;
+        if (c == '"' || c == '\\')
+        {
+            esc[0] = '\\';
+            esc[1] = c;
+            json_raw(jw, esc, 2);
+        }
+        else
+        {
+            memcpy(esc, "\\u00", 4);
+            esc[4] = HEX[c >> 4];
+            esc[5] = HEX[c & 0xF];
+            json_raw(jw, esc, 6);
+        }
+    }
+    json_raw(jw, run, str - run);
+    json_char(jw, '"');
+}
+
+/*
+** json_end() - null terminate the JSON
+**
+** returns its length, or JSON_ERR_TRUNCATED if it did not fit (buf then holds as much as did, null terminated)
+*/
+int json_end(struct JSON_WRITER *jw)
+{
+    if (jw->size == 0)
+        return JSON_ERR_TRUNCATED;
+
+    jw->buf[jw->len] = '\0';
+    return jw->truncated ? JSON_ERR_TRUNCATED : (int)jw->len;
+}
@@ -0,0 +1,38 @@
+/* json_writer.h  Achronite
+ *
+ * Bounded append-cursor JSON writer, used to build the JSON strings returned to node
+ */
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdbool.h>
+
+#define JSON_ERR_TRUNCATED -1
+#define JSON_MAX_PLACES    6        // most decimal places json_fixed() formats itself
+
+struct JSON_WRITER {
+    char *buf;
+    unsigned int len;       // characters written, excluding the null terminator
+    unsigned int size;      // size of buf
+    bool truncated;         // something did not fit, buf holds what did
+};
+
+// append a string literal, its length known at compile time
+#define JSON_LIT(jw, lit) json_raw((jw), (lit), sizeof(lit) - 1)
+
+/***** FUNCTION PROTOTYPES *****/
+void json_init(struct JSON_WRITER *jw, char *buf, unsigned int size);
+void json_raw(struct JSON_WRITER *jw, const char *str, unsigned int n);
+void json_char(struct JSON_WRITER *jw, char c);
+void json_int(struct JSON_WRITER *jw, long long i);
+void json_uint(struct JSON_WRITER *jw, unsigned long long u);
+void json_fixed(struct JSON_WRITER *jw, float f, unsigned int places);
+void json_general(struct JSON_WRITER *jw, float f);
+void json_bool(struct JSON_WRITER *jw, bool b);
+void json_str(struct JSON_WRITER *jw, const char *str);
+int json_end(struct JSON_WRITER *jw);
+
+#endif
+
+/***** END OF FILE *****/
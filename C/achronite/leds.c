@@ -6,19 +6,96 @@
 **
 ** NOTE: spi is abstracted separately, and uses gpio functions if using the software driver
 **
+** The Tx/Rx LEDs are not driven by the radio thread.  leds_Tx(), leds_Rx() and leds_standby() only record the state
+** wanted, a low priority LED thread samples it every LEDS_INTERVAL_MS and makes the gpiod calls, so LED changes are
+** debounced and rate limited and never add syscalls to a radio mode change.  A transmit is always shown for at least
+** one interval, however short.  LEDs can be disabled at runtime with leds_enable(), or left out of the build
+** altogether (including requesting the LED lines) by defining ENER314RT_NO_LEDS.
+**
 ** Achronite: November 2023
 */
 
+#define _GNU_SOURCE     // pthread_setname_np(), SCHED_IDLE
 #include <gpiod.h>      // sudo apt-get install gpiod libgpiod-dev
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include "leds.h"
 
+#define LEDS_INTERVAL_MS 40
+
+enum ledState {LEDS_OFF = 0, LEDS_RX, LEDS_TX};
+
 // Globals
 struct gpiod_chip *chip;
 struct gpiod_line *lineTxLED;  // Red LED
 struct gpiod_line *lineRxLED;  // Green LED
 struct gpiod_line *lineReset;  // Reset Pin
+struct gpiod_line *lineRxIRQ;  // RFM69 DIO0 (PayloadReady)
+
+static int rxIrqAvailable = 0;  // set if DIO0 edge events can be used for receive
+
+// LED state, written by the radio thread and applied by the LED thread
+static atomic_uint ledWanted = LEDS_OFF;
+static atomic_uint ledTxCount = 0;          // transmits started, so that short transmits are still shown
+static atomic_bool ledsEnabled = true;
+
+#ifndef ENER314RT_NO_LEDS
+static atomic_bool ledsRunning = false;
+static atomic_bool ledRefresh = false;      // LEDs changed behind the LED thread's back (board reset)
+static pthread_t ledsThread;
+
+static void _leds_set(int tx, int rx)
+{
+    if (gpiod_line_set_value(lineTxLED, tx) < 0)
+        perror("leds: Set line value Tx failed\n");
+    if (gpiod_line_set_value(lineRxLED, rx) < 0)
+        perror("leds: Set line value Rx failed\n");
+}
+
+/*
+** leds_thread() - apply the wanted LED state, sampled every LEDS_INTERVAL_MS
+*/
+static void *leds_thread(void *arg)
+{
+    struct sched_param param = {0};
+    unsigned int shown = LEDS_OFF, wanted, txCount, txSeen;
+
+    (void)arg;
+    pthread_setname_np(pthread_self(), "ener314rt-leds");
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    txSeen = atomic_load(&ledTxCount);
+    while (atomic_load(&ledsRunning))
+    {
+        usleep(LEDS_INTERVAL_MS * 1000);
+
+        wanted = atomic_load(&ledWanted);
+        txCount = atomic_load(&ledTxCount);
+        if (txCount != txSeen)
+        {
+            // a transmit started since we last looked, show it for this interval even if it has finished
+            wanted = LEDS_TX;
+            txSeen = txCount;
+        }
+        if (!atomic_load(&ledsEnabled))
+            wanted = LEDS_OFF;
+
+        if (wanted != shown || atomic_exchange(&ledRefresh, false))
+        {
+            _leds_set(wanted == LEDS_TX, wanted == LEDS_RX);
+            shown = wanted;
+        }
+    }
+
+    _leds_set(0, 0);
+    return NULL;
+}
+
+#endif
 
 int leds_initialise()
 {
@@ -33,6 +110,7 @@ int leds_initialise()
 		return -1;
     }
 
+#ifndef ENER314RT_NO_LEDS
     // Initialise GPIO lines
     lineRxLED = gpiod_chip_get_line(chip, LED_RX);
     if (!lineRxLED) {
@@ -45,13 +123,15 @@ int leds_initialise()
         perror("leds_initialise(): gpiod_get_line LED_TX failed\n");
         return -3;
     }
-    
+#endif
+
     lineReset = gpiod_chip_get_line(chip, RESET);
-    if (!lineTxLED) {
+    if (!lineReset) {
         perror("leds_initialise(): gpiod_get_line RESET failed\n");
         return -4;
     }
 
+#ifndef ENER314RT_NO_LEDS
     // Set all GPIOs to output
     ret = gpiod_line_request_output(lineRxLED, CONSUMER, 0);
     if (ret < 0) {
@@ -66,6 +146,7 @@ int leds_initialise()
         gpiod_line_release(lineTxLED);
         return ret;
     }
+#endif
 
     ret = gpiod_line_request_output(lineReset, CONSUMER, 0);
     if (ret < 0) {
@@ -74,61 +155,68 @@ int leds_initialise()
         return ret;
     }
 
+    // Request DIO0 as a rising edge event line for interrupt driven receive, this is optional; if it cannot be
+    // requested the receive loop falls back to sleep-polling the radio
+    rxIrqAvailable = 0;
+    lineRxIRQ = gpiod_chip_get_line(chip, RX_IRQ);
+    if (lineRxIRQ) {
+        if (gpiod_line_request_rising_edge_events(lineRxIRQ, CONSUMER) == 0) {
+            rxIrqAvailable = 1;
+        } else {
+            perror("leds_initialise(): gpiod_line_request_rising_edge_events DIO0 failed, polling for Rx");
+        }
+    }
+
+#ifndef ENER314RT_NO_LEDS
+    // LEDs are not essential, carry on without them if the thread cannot be started
+    atomic_store(&ledWanted, LEDS_OFF);
+    atomic_store(&ledsRunning, true);
+    if (pthread_create(&ledsThread, NULL, leds_thread, NULL) != 0) {
+        perror("leds_initialise(): unable to start LED thread");
+        atomic_store(&ledsRunning, false);
+    }
+#endif
+
     return ret;
 }
 
 int leds_Tx()
 {
     // illuminates the Tx LED and switches off the Rx LED
-    int ret = 0;
-
-    ret = gpiod_line_set_value(lineTxLED, 1);
-	if (ret >= 0) {
-        ret = gpiod_line_set_value(lineRxLED, 0);
-	    if (ret < 0) {
-            perror("leds_Tx(): Set line value Rx failed\n");
-        }
-    } else {
-        perror("leds_Tx(): Set line value Tx failed\n");
-    }
-
-    return ret;
+    atomic_fetch_add_explicit(&ledTxCount, 1, memory_order_relaxed);
+    atomic_store_explicit(&ledWanted, LEDS_TX, memory_order_relaxed);
+    return 0;
 }
 
 int leds_Rx()
 {
     // illuminates the Rx LED and switches off the Tx LED
-    int ret = 0;
-
-    ret = gpiod_line_set_value(lineTxLED, 0);
-	if (ret >= 0) {
-        ret = gpiod_line_set_value(lineRxLED, 1);
-	    if (ret < 0) {
-            perror("leds_Rx(): Set line value Rx failed\n");
-        }
-    } else {
-        perror("leds_Rx(): Set line value Tx failed\n");
-    }
-
-    return ret;    
+    atomic_store_explicit(&ledWanted, LEDS_RX, memory_order_relaxed);
+    return 0;
 }
 
 int leds_standby()
 {
     // switches off the Rx and Tx LEDs
-    int ret = 0;
+    atomic_store_explicit(&ledWanted, LEDS_OFF, memory_order_relaxed);
+    return 0;
+}
 
-    ret = gpiod_line_set_value(lineTxLED, 0);
-	if (ret >= 0) {
-        ret = gpiod_line_set_value(lineRxLED, 0);
-	    if (ret < 0) {
-            perror("leds_standby(): Set line value Rx failed\n");
-        }
-    } else {
-        perror("leds_standby(): Set line value Tx failed\n");
-    }
+/*
+** leds_enable() - switch the LEDs on or off at runtime, they stay dark when disabled
+*/
+void leds_enable(int enabled)
+{
+    atomic_store(&ledsEnabled, enabled != 0);
+}
 
-    return ret;    
+int leds_enabled()
+{
+#ifdef ENER314RT_NO_LEDS
+    return 0;
+#else
+    return atomic_load(&ledsEnabled);
+#endif
 }
 
 int leds_reset_board()
@@ -136,47 +224,107 @@ int leds_reset_board()
     // resets the board, flashing the LEDs
     int ret = 0;
 
-    ret = gpiod_line_set_value(lineTxLED, 1);
-	if (ret >= 0) {
-        ret = gpiod_line_set_value(lineRxLED, 1);
-	    if (ret >= 0) {
-            ret = gpiod_line_set_value(lineReset, 1);
-            if (ret >= 0) {
-                usleep(10000);
-                // Hold reset pin HIGH to cause board to reinitialise
-                ret = gpiod_line_set_value(lineReset, 1);
-                if (ret >= 0) {
-                    usleep(150);
-                    // probs safe to assume everything else will run OK, as we have done them all once already
-
-                    // pull RESET pin LOW after short delay
-                    ret = gpiod_line_set_value(lineReset, 0);
-
-                    // switch off LEDs
-                    ret = gpiod_line_set_value(lineRxLED, 0);
-                    ret = gpiod_line_set_value(lineTxLED, 0);
-                } else {
-                    perror("leds_reset_board()): Set line value reset 0 failed\n");
-                }
-            } else {
-                perror("leds_reset_board()): Set line value reset 1 failed\n");
-            }
+#ifndef ENER314RT_NO_LEDS
+    bool flash = leds_enabled() && atomic_load(&ledsRunning);
+
+    if (flash)
+        _leds_set(1, 1);
+#endif
+
+    ret = gpiod_line_set_value(lineReset, 1);
+    if (ret >= 0) {
+        usleep(10000);
+        // Hold reset pin HIGH to cause board to reinitialise
+        ret = gpiod_line_set_value(lineReset, 1);
+        if (ret >= 0) {
+            usleep(150);
+
+            // pull RESET pin LOW after short delay
+            ret = gpiod_line_set_value(lineReset, 0);
         } else {
-            perror("leds_reset_board()): Set line value Rx failed\n");
+            perror("leds_reset_board()): Set line value reset 0 failed\n");
         }
     } else {
-        perror("leds_Rx(): Set line value Tx failed\n");
+        perror("leds_reset_board()): Set line value reset 1 failed\n");
     }
 
+#ifndef ENER314RT_NO_LEDS
+    // switch off LEDs, the LED thread puts back whatever the radio wants
+    if (flash) {
+        _leds_set(0, 0);
+        atomic_store(&ledRefresh, true);
+    }
+#endif
+    atomic_store(&ledWanted, LEDS_OFF);
+
     return ret;
     
 }
 
+int leds_rx_irq_available()
+{
+    return rxIrqAvailable;
+}
+
+/*
+** leds_rx_irq_fd() - file descriptor that becomes readable when the radio raises DIO0 (PayloadReady)
+**
+** returns the fd for use with poll(), or -1 if the DIO0 line is unavailable
+*/
+int leds_rx_irq_fd()
+{
+    if (!rxIrqAvailable)
+        return -1;
+
+    return gpiod_line_event_get_fd(lineRxIRQ);
+}
+
+/*
+** leds_rx_irq_clear() - consume a pending DIO0 edge so that the fd blocks until the next one
+**
+** returns 1 if an edge was consumed, -1 on error
+*/
+int leds_rx_irq_clear()
+{
+    struct gpiod_line_event event;
+
+    if (!rxIrqAvailable)
+        return -1;
+
+    if (gpiod_line_event_read(lineRxIRQ, &event) < 0) {
+        perror("leds_rx_irq_clear(): gpiod_line_event_read failed\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+** leds_rx_irq_level() - current level of DIO0, high whilst a received payload is waiting in the FIFO
+**
+** returns 1 or 0, or -1 if the DIO0 line is unavailable
+*/
+int leds_rx_irq_level()
+{
+    if (!rxIrqAvailable)
+        return -1;
+
+    return gpiod_line_get_value(lineRxIRQ);
+}
+
 void leds_close()
 {
+#ifndef ENER314RT_NO_LEDS
+    // Stop the LED thread before the lines go
+    if (atomic_exchange(&ledsRunning, false))
+        pthread_join(ledsThread, NULL);
+#endif
+
     // Close GPIO chip (gpiod)
     if (chip)
     {
+        rxIrqAvailable = 0;
         gpiod_chip_close(chip);
+        chip = NULL;
     }
 }
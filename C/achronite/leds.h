@@ -19,6 +19,10 @@
 // GREEN used for RX, RED used for TX
 #define LED_RX 27 // (not B rev1)
 #define LED_TX 22
+// RFM69 DIO0 - mapped to PayloadReady whilst in receive mode (see config_Shared in radio.c)
+#ifndef RX_IRQ
+#define RX_IRQ 24
+#endif
 
 // Function prototypes
 
@@ -26,5 +30,11 @@ int leds_initialise();
 int leds_Tx();
 int leds_Rx();
 int leds_standby();
+void leds_enable(int enabled);
+int leds_enabled();
 int leds_reset_board();
+int leds_rx_irq_available();
+int leds_rx_irq_fd();
+int leds_rx_irq_clear();
+int leds_rx_irq_level();
 void leds_close();
\ No newline at end of file
@@ -1,294 +1,1009 @@
+#define _GNU_SOURCE                     // pthread_setaffinity_np(), pthread_setname_np()
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <errno.h>
-#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 #include "lock_radio.h"
+#include "rx_ring.h"
 #include "openThings.h"
+#include "leds.h"
 #include "../energenie/radio.h"
 #include "../energenie/hrfm69.h"
 #include "../energenie/trace.h"
 
 /*
-** C module addition to energenie code to perform the receiving and locking for the Energenie ENER314-RT board
-** It also provides the common functions for mutex locking, and radio initialisation
+** C module addition to energenie code to perform the receiving and serialisation for the Energenie ENER314-RT board
+** It also provides the radio initialisation and shutdown
 **
 ** Author: Phil Grainger - @Achronite, March 2019 - Dec 2010
 **
 ** 10 Jan 2020 v0.3.1 Call init function if not already done so when attempting to lock radio
+** Replaced fixed 5 message RxMsgs array with a sized receive ring (rx_ring.c)
+** Replaced the radio mutex with a radio owner thread:
+**   All access to the radio (SPI and GPIO) is made from a single owner thread.  Other threads build a RADIO_REQ and
+**   submit it on a lock-free multi-producer / single-consumer queue, then wait on the request's semaphore for the
+**   result.  The owner sleeps in poll() on an eventfd (new requests) and the DIO0 line (PayloadReady), so when
+**   monitoring it drains the radio into the receive ring as soon as a message lands and wakes every receive loop by
+**   advancing rxGen.
 **
 */
 
-/* declare radio lock for multi-threading */
-pthread_mutexattr_t attr;
-pthread_mutex_t radio_mutex;
+enum deviceTypes deviceType = DT_CONTROL; // types of devices in use to control loop behaviour (owner thread only)
+
+static bool initialised = false;        // radio_init() has completed (owner thread only)
+
+// owner thread lifecycle; owner_mutex is only held while starting or stopping the thread, never on the request path
+static pthread_mutex_t owner_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ownerThread;
+static atomic_bool running = false;     // owner thread is accepting requests
+static atomic_uint submitters = 0;      // threads part way through queuing a request
+
+// the eventfd is created once and kept open for the life of the process, so that the owner and submitters never
+// see it closed (or the fd number reused) beneath them when the radio is closed
+static pthread_once_t eventFdsOnce = PTHREAD_ONCE_INIT;
+static int reqEventFd = -1;             // signalled when a request is queued
+
+// receive wake-ups are broadcast: several threads can be waiting for the ring at once (the monitor thread, the async
+// receive thread and a synchronous openThingsReceive) and a single eventfd read would only wake one of them
+static pthread_mutex_t rxWaitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rxWaitCond;       // CLOCK_MONOTONIC, broadcast whenever rxGen advances
+static atomic_uint rxGen = 0;           // advanced when the owner has stored received messages, or on wake_radio_Rx()
+
+// request queue (Vyukov intrusive MPSC): producers swap qHead, only the owner thread touches qTail
+static struct RADIO_REQ qStub;
+static struct RADIO_REQ *_Atomic qHead = &qStub;
+static struct RADIO_REQ *qTail = &qStub;
+
+static uint32_t rxSeq = 0;              // last receive sequence number issued (owner thread only)
+static bool irqPolling = false;         // DIO0 edges are being missed, poll the radio instead (owner thread only)
+static _Thread_local struct RADIO_TX_INFO lastTx;  // last transmit made by each calling thread, see radio_last_tx()
+static atomic_uint heapAllocs = 0;      // heap allocations made by the addon, should not move whilst receiving
+
+// radio drain counters (owner thread only)
+static struct {
+    uint32_t drains;                    // drains that found at least one packet
+    uint32_t packets;                   // packets read from the radio
+    uint32_t bytes;                     // OpenThings payload bytes stored
+    uint32_t discarded;                 // packets that could not be OpenThings messages
+    uint32_t missedEdges;               // safety drains that found packets no DIO0 edge reported
+    uint32_t lastPackets;               // packets read by the last drain
+    uint32_t lastBytes;                 // payload bytes stored by the last drain
+    uint32_t maxPackets;                // most packets read in one drain
+    uint32_t lastUs;                    // time taken by the last drain, from waking to the packets being in the ring
+    uint32_t maxUs;
+    uint64_t totalUs;
+} drainStats;
+
+// decode stage counters, see rx_decoded().  Every receive loop (the monitor thread, the async receive thread and a
+// synchronous openThingsReceive) records its decodes here, so they are updated and read under decodeMutex
+static pthread_mutex_t decodeMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct DECODE_STATS {
+    uint32_t count;                     // messages decoded
+    uint32_t lastUs;                    // time from the message being stored in the ring to it being decoded
+    uint32_t maxUs;
+    uint64_t totalUs;
+} decodeStats;
+
+// receive ring configuration, applied when the radio is initialised
+static unsigned int rxRingSize = RX_RING_DEFAULT_SIZE;
+static enum rxDropPolicy rxRingPolicy = RX_DROP_OLDEST;
+static bool rxRingChanged = false;      // reallocate the ring at the next init (owner_mutex)
+
+// radio watchdog (owner thread only)
+#define RADIO_WATCHDOG_MS    5000       // time between health checks
+#define RADIO_RECOVERY_TRIES 3          // resets to attempt per check
+#define RADIO_RX_POLL_MS     20         // radio poll interval whilst monitoring without DIO0
+#define RADIO_RX_SAFETY_MS   500        // safety drain interval whilst monitoring with DIO0, in case an edge is missed
+#define RADIO_IRQ_MISS_LIMIT 3          // safety drains in a row finding packets before DIO0 is given up on
+static struct {
+    uint32_t checks;                    // health checks made
+    uint32_t failures;                  // checks that found the radio unhealthy
+    uint32_t recoveries;                // radio reset and reloaded successfully
+    uint32_t recoveryFailures;          // radio still unhealthy after RADIO_RECOVERY_TRIES resets
+    uint32_t lastRecoveryUs;            // time from detecting the failure to the radio being healthy again
+    uint32_t maxRecoveryUs;
+} watchdogStats;
+
+// radio owner thread scheduling (owner_mutex), see set_radio_thread_config()
+static bool threadConfigured = false;
+static int threadPriority = 0;          // SCHED_FIFO priority, 0 for normal scheduling
+static uint32_t threadCpus = 0;         // CPU affinity mask, 0 for any CPU
+static bool threadLockMem = false;      // mlockall() the process
+static bool memLocked = false;
+static int threadResult = 0;            // result of the last _apply_thread_config()
+
+static void _queue_push(struct RADIO_REQ *req)
+{
+    struct RADIO_REQ *prev;
 
-static bool initialised = false;
+    atomic_store_explicit(&req->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&qHead, req, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, req, memory_order_release);
+}
 
-enum deviceTypes deviceType = DT_CONTROL; // types of devices in use to control loop behaviour
+/*
+** _queue_pop() - owner thread only
+**
+** returns the next request, or NULL if the queue is empty (or a producer is part way through a push, in which case
+** it will signal reqEventFd again once the push is complete)
+*/
+static struct RADIO_REQ *_queue_pop(void)
+{
+    struct RADIO_REQ *tail = qTail;
+    struct RADIO_REQ *next = atomic_load_explicit(&tail->next, memory_order_acquire);
 
-static struct RADIO_MSG RxMsgs[RX_MSGS];
-static int pRxMsgHead = 0; // pointer to the next slot to load a Rx msg into in our Rx Msg FIFO
-static int pRxMsgTail = 0; // pointer to the next msg to read from Rx Msg FIFO, if head=tail the buffer is empty
+    if (tail == &qStub)
+    {
+        if (next == NULL)
+            return NULL;
+        qTail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
 
-/* init_ener314rt() - initialise radio adaptor in a multi-threaded environment
+    if (next != NULL)
+    {
+        qTail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&qHead, memory_order_acquire))
+        return NULL;
+
+    // tail is the last request, put the stub back behind it so that it can be unlinked
+    _queue_push(&qStub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
+    {
+        qTail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void _signal(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) != sizeof(one))
+    {
+        TRACE_FAIL("radio_owner: eventfd write failed\n");
+    }
+}
+
+// reset an eventfd counter, discarding any signal left over from a previous open (fd < 0 is ignored)
+static void _clear(int fd)
+{
+    uint64_t count;
+
+    (void)!read(fd, &count, sizeof(count));
+}
+
+static void _create_event_fds(void)
+{
+    pthread_condattr_t attr;
+
+    reqEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rxWaitCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// wake everyone in wait_radio_Rx()
+static void _rx_notify(void)
+{
+    pthread_mutex_lock(&rxWaitMutex);
+    atomic_fetch_add(&rxGen, 1);
+    pthread_cond_broadcast(&rxWaitCond);
+    pthread_mutex_unlock(&rxWaitMutex);
+}
+
+/*
+** _drain_radio() - empties the radio receive buffer of any messages into the receive ring as quickly as possible
 **
-** mutex locking is performed here AND RETAINED if lock=true
+** owner thread only.  Leave the radio in receive mode if monitoring, as this could have been the first time we have
+** been called.  If the receive ring is full the configured drop policy decides which message is lost, see
+** set_rx_ring_config()
 **
-** @Achronite - March 2019
-** 
+** irq is true when the owner has just consumed a DIO0 PayloadReady edge, so the first packet can be read in a single
+** transaction
+**
+** returns the # of messages read
 */
-int init_ener314rt(int lock)
+static int _drain_radio(enum deviceTypes rxMode, bool irq)
 {
-    int ret = 0;
+    int recs = 0;
+    unsigned int i, bytes = 0;
+    struct RADIO_MSG rxMsg;
+    RADIO_RX_STATUS rxStatus;
+    struct timespec ts, start;
+    uint32_t us;
 
-    if (!initialised)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Put us into monitor mode as soon as we know about it
+    if (rxMode == DT_MONITOR)
+        deviceType = DT_MONITOR;
+
+    // only empty buffer if we need to
+    if (deviceType == DT_MONITOR || rxMode == DT_LEARN)
     {
-        //initialise radio
-        TRACE_OUTS("init_ener314(");
-        TRACE_OUTN(lock);
-        TRACE_OUTS("): Initialising\n");
+        // only receive data if we are in monitor mode
+        // Set FSK mode receive for OpenThings devices (Energenie OOK devices dont generally transmit!)
+        radio_setmode(RADIO_MODULATION_FSK, HRF_MODE_RECEIVER);
 
-        // set mutex type to not deadlock if relocking the same mutex
-        if ((ret = pthread_mutexattr_init(&attr)) == 0)
+        // read every packet waiting (bounded by the ring size in case the radio flag is stuck)
+        // The signal quality is read in the same transaction, before the FIFO is emptied and the receiver restarts
+        for (i = 0; i < rx_ring_size(); i++)
         {
-            if ((ret = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK)) == 0)
-            {
-                // TODO: use the mutex attr!
-                if ((ret = pthread_mutex_init(&radio_mutex, NULL)) != 0)
-                {
-                    // mutex failure
-                    TRACE_OUTS("init_ener314(): mutex init failed err=");
-                    TRACE_OUTN(ret);
-                    TRACE_NL();
-
-                    if (lock && (ret == EBUSY))
-                    {
-                        // another process has the lock; lets spin on the lock assuming that another thread has initialised the radio & mutex
-                        TRACE_OUTS("init_ener314(): initialised already, await lock\n");
-                        return pthread_mutex_lock(&radio_mutex);
-                    }
-                }
+            if (radio_get_rx_packet(&rxStatus, rxMsg.msg, MAX_FIFO_BUFFER, irq && i == 0) != RADIO_RESULT_OK || !rxStatus.waiting)
+                break;
 
-                // mutex initialised; lock it
-                if ((ret = pthread_mutex_lock(&radio_mutex)) == 0)
-                {
-                    // thread safe, set initialised
-                    TRACE_OUTS("init_ener314(): mutex created & locked\n");
-                    if ((ret = radio_init()) == 0)
-                    {
-                        // place radio in known modulation and mode - FSK:Standby
-                        initialised = true;
-                        radio_setmode(RADIO_MODULATION_FSK,HRF_MODE_STANDBY);
-                    }
-
-                    if (!lock)
-                    {
-                        // unlock mutex if not required to be retained
-                        TRACE_OUTS("init_ener314(): mutex unlocked\n");
-                        pthread_mutex_unlock(&radio_mutex);
-                    }
-                }
+            if (rxMsg.msg[0] == 0)
+            {
+                drainStats.discarded++;
+                continue;
             }
+            recs++;
+            bytes += rxMsg.msg[0];
+
+            rxMsg.rssi = rxStatus.rssi;
+            rxMsg.afc = rxStatus.afc;
+            rxMsg.fei = rxStatus.fei;
+
+            // record message timestamps and sequence
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            rxMsg.monoNs = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+            rxMsg.t = time(0);
+            rxMsg.seq = ++rxSeq;
+            TRACE_OUTC(64);
+
+            rx_ring_push(&rxMsg);
+        }
+
+        if (i > 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            us = (uint32_t)((ts.tv_sec - start.tv_sec) * 1000000L + (ts.tv_nsec - start.tv_nsec) / 1000);
+            drainStats.lastUs = us;
+            drainStats.totalUs += us;
+            if (us > drainStats.maxUs)
+                drainStats.maxUs = us;
+            drainStats.drains++;
+            drainStats.packets += i;
+            drainStats.bytes += bytes;
+            drainStats.lastPackets = i;
+            drainStats.lastBytes = bytes;
+            if (i > drainStats.maxPackets)
+                drainStats.maxPackets = i;
         }
     }
+
+    if (recs > 0)
+        _rx_notify();
+
+    return recs;
+}
+
+static int _process_req(struct RADIO_REQ *req)
+{
+    int ret = 0;
+    RADIO_TX_STATS txStats;
+    struct timespec ts;
+
+    switch (req->type)
+    {
+    case RRQ_INIT:
+        if ((ret = radio_init()) == 0)
+        {
+            // place radio in known modulation and mode - FSK:Standby
+            initialised = true;
+            radio_setmode(RADIO_MODULATION_FSK, HRF_MODE_STANDBY);
+        }
+        break;
+    case RRQ_CLOSE:
+        if (initialised)
+        {
+            radio_finished();
+            initialised = false;
+        }
+        deviceType = DT_CONTROL; // set back to control mode only
+        irqPolling = false;      // give DIO0 another chance when next opened
+        break;
+    case RRQ_TX:
+        if (!initialised)
+        {
+            ret = -1;
+            break;
+        }
+        // flush Rx buffer if required, so that nothing received is lost whilst we transmit
+        _drain_radio(DT_CONTROL, false);
+        radio_mod_transmit(req->mod, req->payload, req->len, req->times);
+
+        radio_get_tx_stats(&txStats);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        req->txInfo.airtimeUs = txStats.lastAirtimeUs;
+        req->txInfo.txUs = txStats.lastTxUs;
+        req->txInfo.doneNs = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+        break;
+    case RRQ_RX_DRAIN:
+        ret = initialised ? _drain_radio(req->rxMode, false) : -1;
+        break;
+    default:
+        ret = -1;
+    }
+
     return ret;
 }
 
 /*
-** lock_ener314rt() - lock the mutex to ensure we have exclusive access to radio adaptor in multithreaded environment
+** _apply_thread_config() - set the scheduling policy and CPU affinity of thread, and lock or unlock memory
 **
-** Copes with conditions where we already have the lock
+** called with owner_mutex held.  returns 0, or the first failure: -1 priority (needs CAP_SYS_NICE or an rtprio
+** limit), -2 affinity, -3 memory lock (needs CAP_IPC_LOCK or a memlock limit)
 */
-int lock_ener314rt(void)
+static int _apply_thread_config(pthread_t thread)
 {
-    int ret = -1;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int i, ret = 0;
 
-    if (initialised)
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = threadPriority;
+    if (pthread_setschedparam(thread, threadPriority > 0 ? SCHED_FIFO : SCHED_OTHER, &param) != 0)
     {
-        // lock radio now
-#ifdef LOCKTRACE
-        TRACE_OUTS("[L");
-        TRACE_OUTN((int)pthread_self());
-        TRACE_OUTS("]");
-#endif
+        TRACE_FAIL("radio_owner: unable to set thread priority\n");
+        ret = -1;
+    }
 
-        ret = pthread_mutex_lock(&radio_mutex);
-        //printf("-%d-", (int)pthread_self());
-        //fflush(stdout);
+    if (threadCpus != 0)
+    {
+        CPU_ZERO(&cpus);
+        for (i = 0; i < 32; i++)
+            if (threadCpus & (1UL << i))
+                CPU_SET(i, &cpus);
+        if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+        {
+            TRACE_FAIL("radio_owner: unable to set CPU affinity\n");
+            if (ret == 0)
+                ret = -2;
+        }
+    }
 
-        // cater for if we already have the lock
-        if (ret == EDEADLK)
+    if (threadLockMem && !memLocked)
+    {
+        // lock the pages in use now, including the receive ring and thread stacks, as they are touched; memory
+        // allocated later by node is left alone
+#ifdef MCL_ONFAULT
+        if (mlockall(MCL_CURRENT | MCL_ONFAULT) != 0)
+#else
+        if (mlockall(MCL_CURRENT) != 0)
+#endif
         {
-            // mutex already locked, this is fine!
-            ret = 0;
+            TRACE_FAIL("radio_owner: unable to lock memory\n");
+            if (ret == 0)
+                ret = -3;
         }
+        else
+            memLocked = true;
     }
-    else
+    else if (!threadLockMem && memLocked)
     {
-        // radio not initialised, do it now
-        TRACE_OUTS("lock_ener314(): Radio not initialised, calling init_ener314rt()\n");
-        ret = init_ener314rt(true);
+        munlockall();
+        memLocked = false;
     }
 
-    return ret;
-}
-
-int unlock_ener314rt(void)
-{
-    int ret = 0;
-    //unlock mutex
-#ifdef LOCKTRACE
-    TRACE_OUTS("[");
-    TRACE_OUTN((int)pthread_self());
-    TRACE_OUTS("U]");
-#endif
-    ret = pthread_mutex_unlock(&radio_mutex);
+    threadResult = ret;
     return ret;
 }
 
 /*
-** elegant shutdown of radio adaptor
+** _watchdog() - check the radio is healthy, resetting and reloading it if not
+**
+** owner thread only, called every RADIO_WATCHDOG_MS and straight after anything that saw the radio misbehave
 */
-void close_ener314rt(void)
+static void _watchdog(void)
 {
-    //Elegant shutdown of ener314rt
-    TRACE_OUTS("close_ener314(): called\n");
-    if (lock_ener314rt() == 0)
+    struct timespec start, now;
+    uint32_t us;
+    int tries;
+
+    watchdogStats.checks++;
+    if (radio_check_health())
+        return;
+
+    watchdogStats.failures++;
+    TRACE_FAIL("radio_owner(): radio not responding, resetting\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (tries = 0; tries < RADIO_RECOVERY_TRIES; tries++)
     {
-        // we have the lock, do all the tidying
-        radio_finished();
-        initialised = false;
-        deviceType = DT_CONTROL; // set back to control mode only
-        pthread_mutex_destroy(&radio_mutex);
-        TRACE_OUTS("close_ener314(): done\n");
+        if (radio_recover() == 0 && radio_check_health())
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (uint32_t)((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000);
+
+    if (tries < RADIO_RECOVERY_TRIES)
+    {
+        watchdogStats.recoveries++;
+        watchdogStats.lastRecoveryUs = us;
+        if (us > watchdogStats.maxRecoveryUs)
+            watchdogStats.maxRecoveryUs = us;
+        TRACE_OUTS("radio_owner(): radio recovered\n");
     }
     else
     {
-        TRACE_OUTS("close_ener314(): couldnt get lock\n");
+        // try again at the next check
+        watchdogStats.recoveryFailures++;
+        TRACE_FAIL("radio_owner(): radio recovery failed\n");
     }
 }
 
 /*
-** empty_radio_Rx_buffer() - empties the radio receive buffer of any messages into RxMsgs as quickly as possible
-**
-** Need to mutex lock before calling this function
-** Leave the radio in receive mode if monitoring, as this could have been the first time we have been called
+** radio_owner() - the only thread that talks to the radio
+*/
+static void *radio_owner(void *arg)
+{
+    struct pollfd fds[2];
+    struct RADIO_REQ *req;
+    uint64_t count;
+    bool stop = false;
+    nfds_t nfds;
+    int timeout;
+    unsigned int missed = 0;
+    struct timespec now, lastCheck, lastDrain;
+
+    (void)arg;
+    TRACE_OUTS("radio_owner(): started\n");
+
+    pthread_setname_np(pthread_self(), "ener314rt-radio");
+
+    clock_gettime(CLOCK_MONOTONIC, &lastCheck);
+    lastDrain = lastCheck;
+    fds[0].fd = reqEventFd;
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    while (!stop)
+    {
+        // DIO0 is only available once the radio has been initialised
+        nfds = 1;
+        if (initialised && !irqPolling && (fds[1].fd = leds_rx_irq_fd()) >= 0)
+            nfds = 2;
+
+        // without DIO0 we poll the radio ourselves whilst monitoring, so draining never waits for the decoder.  With
+        // DIO0 the radio is still drained every RADIO_RX_SAFETY_MS, so that an unwired line or a missed edge (DIO0
+        // stays high until the FIFO is emptied) cannot stop us receiving
+        timeout = -1;
+        if (initialised)
+        {
+            timeout = RADIO_WATCHDOG_MS;
+            if (deviceType == DT_MONITOR)
+                timeout = (nfds == 1) ? RADIO_RX_POLL_MS : RADIO_RX_SAFETY_MS;
+        }
+
+        if (poll(fds, nfds, timeout) < 0)
+        {
+            if (errno != EINTR)
+            {
+                TRACE_FAIL("radio_owner(): poll failed\n");
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            if (read(reqEventFd, &count, sizeof(count)) != sizeof(count))
+            {
+                TRACE_FAIL("radio_owner(): eventfd read failed\n");
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (nfds == 2 && (fds[1].revents & POLLIN))
+        {
+            // PayloadReady, only drain here if the receive loop has asked us to monitor
+            leds_rx_irq_clear();
+            if (deviceType == DT_MONITOR)
+            {
+                if (_drain_radio(DT_MONITOR, true) > 0)
+                    missed = 0;
+                lastDrain = now;
+            }
+        }
+        else if (nfds == 1 && initialised && deviceType == DT_MONITOR)
+        {
+            _drain_radio(DT_MONITOR, false);
+        }
+        else if (nfds == 2 && deviceType == DT_MONITOR &&
+                 (now.tv_sec - lastDrain.tv_sec) * 1000 + (now.tv_nsec - lastDrain.tv_nsec) / 1000000 >= RADIO_RX_SAFETY_MS)
+        {
+            // safety drain, anything found here was not reported by DIO0
+            lastDrain = now;
+            if (_drain_radio(DT_MONITOR, false) > 0)
+            {
+                drainStats.missedEdges++;
+                if (++missed >= RADIO_IRQ_MISS_LIMIT)
+                {
+                    TRACE_FAIL("radio_owner(): DIO0 edges missed, polling the radio instead\n");
+                    irqPolling = true;
+                }
+            }
+        }
+
+        while ((req = _queue_pop()) != NULL)
+        {
+            req->result = _process_req(req);
+            if (req->type == RRQ_CLOSE)
+                stop = true;
+            // req belongs to the submitter again after this
+            sem_post(&req->done);
+        }
+
+        // check the radio every RADIO_WATCHDOG_MS however busy we are, or as soon as it has misbehaved
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (initialised && !stop && (radio_faulted() || now.tv_sec - lastCheck.tv_sec >= RADIO_WATCHDOG_MS / 1000))
+        {
+            _watchdog();
+            lastCheck = now;
+        }
+    }
+
+    TRACE_OUTS("radio_owner(): stopped\n");
+    return NULL;
+}
+
+/*
+** _submit() - queue a request to the owner thread and wait for it to complete
+*/
+static int _submit(struct RADIO_REQ *req)
+{
+    sem_init(&req->done, 0, 0);
+    _queue_push(req);
+    _signal(reqEventFd);
+    atomic_fetch_sub(&submitters, 1);
+
+    while (sem_wait(&req->done) != 0 && errno == EINTR)
+        ;
+    sem_destroy(&req->done);
+
+    return req->result;
+}
+
+/* init_ener314rt() - initialise radio adaptor in a multi-threaded environment
 **
-** returns the # of messages read
+** Starts the radio owner thread and initialises the radio from it.  lock is retained for compatibility, exclusive
+** access is now provided by the owner thread so it has no effect.
 **
-** TODO: Buffer is currently cyclic and destructive, we could lose messages, but I've made the assumption we always need
-**       the latest messages
+** @Achronite - March 2019
 **
 */
-int empty_radio_Rx_buffer(enum deviceTypes rxMode)
+int init_ener314rt(int lock)
 {
-    int i, recs = 0;
+    int ret = 0;
+    struct RADIO_REQ req;
 
-    // Put us into monitor mode as soon as we know about it
-    if (rxMode == DT_MONITOR)
-        deviceType = DT_MONITOR;
+    (void)lock;
 
-    // only empty buffer if we need to
-    if (deviceType == DT_MONITOR || rxMode == DT_LEARN)
+    pthread_mutex_lock(&owner_mutex);
+    if (!atomic_load(&running))
     {
-        // only receive data if we are in monitor mode
-        // Set FSK mode receive for OpenThings devices (Energenie OOK devices dont generally transmit!)
-        radio_setmode(RADIO_MODULATION_FSK, HRF_MODE_RECEIVER);
+        //initialise radio
+        TRACE_OUTS("init_ener314(): Initialising\n");
 
-        i = 0;
-        // do we have any messages waiting?
-        while (radio_is_receive_waiting() && (i++ < RX_MSGS))
+        // (re)create the receive ring if it does not exist yet or has been reconfigured; receive loops may still be
+        // polling the old ring, rx_ring_init() waits for them before freeing it
+        if (rx_ring_size() == 0 || rxRingChanged)
         {
-            if (radio_get_payload_cbp(RxMsgs[pRxMsgHead].msg, MAX_FIFO_BUFFER) == RADIO_RESULT_OK)
-            {
-                recs++;
-                // TODO: Only store valid OpenThings messages?
-
-                // record message timestamp
-                RxMsgs[pRxMsgHead].t = time(0);
-                TRACE_OUTC(64);
+            ret = rx_ring_init(rxRingSize, rxRingPolicy);
+            rxRingChanged = false;
+        }
 
-                // wrap round buffer for next Rx
-                if (++pRxMsgHead == RX_MSGS)
-                    pRxMsgHead = 0;
+        if (ret == 0)
+        {
+            pthread_once(&eventFdsOnce, _create_event_fds);
+            _clear(reqEventFd);
+            if (reqEventFd < 0)
+            {
+                TRACE_FAIL("init_ener314(): eventfd failed\n");
+                ret = -1;
+            }
+            else if ((ret = pthread_create(&ownerThread, NULL, radio_owner, NULL)) != 0)
+            {
+                TRACE_FAIL("init_ener314(): unable to start radio owner thread\n");
             }
             else
             {
-                TRACE_OUTS("empty_radio_Rx_buffer(): invalid OT payload\n");
-                break;
+                if (threadConfigured)
+                    _apply_thread_config(ownerThread);
+                atomic_store(&running, true);
+
+                req.type = RRQ_INIT;
+                atomic_fetch_add(&submitters, 1);
+                if ((ret = _submit(&req)) != 0)
+                {
+                    // radio failed, take the owner thread down again
+                    atomic_store(&running, false);
+                    req.type = RRQ_CLOSE;
+                    atomic_fetch_add(&submitters, 1);
+                    _submit(&req);
+                    pthread_join(ownerThread, NULL);
+                }
             }
         }
     }
-    return recs;
-};
+    pthread_mutex_unlock(&owner_mutex);
+
+    return ret;
+}
 
 /*
-** pop_msg() - returns next unread message from Rx queue
-**
-** returns -1 if no messages, or # of msg remaining in FIFO
+** elegant shutdown of radio adaptor
 **
-** TODO: Implement mutex on rxMsg buffer
+** Requests already queued are completed first, anything submitted after this point is rejected
 */
-int pop_RxMsg(struct RADIO_MSG *rxMsg)
+void close_ener314rt(void)
 {
-    int ret = -1;
+    struct RADIO_REQ req;
 
-    //printf("<%d-%d>", pRxMsgHead, pRxMsgTail);
-    if (pRxMsgHead != pRxMsgTail)
+    //Elegant shutdown of ener314rt
+    TRACE_OUTS("close_ener314(): called\n");
+
+    pthread_mutex_lock(&owner_mutex);
+    if (atomic_exchange(&running, false))
     {
-        memcpy(rxMsg->msg, RxMsgs[pRxMsgTail].msg, sizeof(rxMsg->msg));
+        // receive loops see that we are closing as soon as they wake, rather than at the end of their timeout
+        _rx_notify();
 
-        // null out read message
-        memset(RxMsgs[pRxMsgTail].msg, 0, MAX_FIFO_BUFFER);
-        rxMsg->t = RxMsgs[pRxMsgTail].t;
+        // wait for any threads that are part way through queuing so that the close request is last
+        while (atomic_load(&submitters) > 0)
+            usleep(100);
 
-        // move tail to next msg in buffer
-        if (++pRxMsgTail == RX_MSGS)
-            pRxMsgTail = 0;
+        req.type = RRQ_CLOSE;
+        atomic_fetch_add(&submitters, 1);
+        _submit(&req);
+        pthread_join(ownerThread, NULL);
 
-        if (pRxMsgHead >= pRxMsgTail)
-        {
-            ret = pRxMsgHead - pRxMsgTail;
-        }
-        else
+        // wake anyone still waiting for receive data
+        _rx_notify();
+        TRACE_OUTS("close_ener314(): done\n");
+    }
+    pthread_mutex_unlock(&owner_mutex);
+}
+
+/*
+** radio_submit() - have the radio owner thread carry out req, blocking until it is complete
+**
+** The radio is initialised first if this has not already been done.  req only needs to live until this returns.
+**
+** returns the request result, or -1 if the radio is not available
+*/
+int radio_submit(struct RADIO_REQ *req)
+{
+    int tries;
+
+    for (tries = 0; tries < 2; tries++)
+    {
+        atomic_fetch_add(&submitters, 1);
+        if (atomic_load(&running))
+            return _submit(req);
+        atomic_fetch_sub(&submitters, 1);
+
+        if (tries == 0)
         {
-            ret = pRxMsgHead + RX_MSGS - pRxMsgTail;
+            // radio not initialised, do it now
+            TRACE_OUTS("radio_submit(): Radio not initialised, calling init_ener314rt()\n");
+            if (init_ener314rt(false) != 0)
+                break;
         }
     }
 
-    //printf("pop_RxMsg(%d): %d\n", ret, (int)rxMsg->t);
+    return -1;
+}
+
+/*
+** radio_tx() - transmit a payload a number of times from the owner thread
+**
+** Any messages waiting in the radio are moved to the receive ring first
+*/
+int radio_tx(unsigned char mod, unsigned char *payload, unsigned char len, unsigned char times)
+{
+    struct RADIO_REQ req;
+    int ret;
+
+    req.type = RRQ_TX;
+    req.mod = mod;
+    req.payload = payload;
+    req.len = len;
+    req.times = times;
+    memset(&req.txInfo, 0, sizeof(req.txInfo));
+
+    ret = radio_submit(&req);
+    lastTx = req.txInfo;
 
     return ret;
 }
 
 /*
-** get_Rxmsg() - returns message msgNum from Rx queue
+** radio_last_tx() - returns the airtime and completion time of the last radio_tx() made by the calling thread
 **
-** This performs a simple memory copy, and does not perform ANY checking that message is valid
+** Transmits are carried out by the owner thread one after the other, so this is always the caller's own transmit
+** even when several threads are sending.
+*/
+void radio_last_tx(struct RADIO_TX_INFO *txInfo)
+{
+    *txInfo = lastTx;
+}
+
+/*
+** empty_radio_Rx_buffer() - have the owner thread empty the radio receive buffer into the receive ring
+**
+** returns the # of messages read, or -1 if the radio is not available
+*/
+int empty_radio_Rx_buffer(enum deviceTypes rxMode)
+{
+    struct RADIO_REQ req;
+
+    req.type = RRQ_RX_DRAIN;
+    req.rxMode = rxMode;
+
+    return radio_submit(&req);
+};
+
+/*
+** pop_msg() - returns next unread message from Rx queue
+**
+** returns -1 if no messages, or # of msg remaining in FIFO
+*/
+int pop_RxMsg(struct RADIO_MSG *rxMsg)
+{
+    return rx_ring_pop(rxMsg);
+}
+
+/*
+** get_Rxmsg() - returns unread message msgNum from Rx queue, without removing it
 **
+** returns the message timestamp, or -1 if msgNum is not in the queue
 */
 int get_RxMsg(int msgNum, struct RADIO_MSG *rxMsg)
 {
-    if (msgNum < 0 || msgNum >= RX_MSGS)
+    if (msgNum < 0)
     {
         // out of range
         return -1;
     }
 
-    memcpy(rxMsg->msg, RxMsgs[msgNum].msg, sizeof(rxMsg->msg));
-    rxMsg->t = RxMsgs[msgNum].t;
+    return rx_ring_peek(msgNum, rxMsg);
+}
+
+/*
+** set_rx_ring_config() - set the size of the receive ring and what to drop when it overflows
+**
+** size is rounded up to a power of 2, dropPolicy is 0 to drop the oldest message or 1 to drop the newest.
+** This has to be called before the radio is initialised (or after it is closed).
+**
+** returns 0 if OK, -1 if the radio is already initialised
+*/
+int set_rx_ring_config(unsigned int size, unsigned int dropPolicy)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&owner_mutex);
+    if (atomic_load(&running))
+    {
+        TRACE_OUTS("set_rx_ring_config(): radio already initialised\n");
+        ret = -1;
+    }
+    else
+    {
+        rxRingSize = size;
+        rxRingPolicy = (dropPolicy == RX_DROP_NEWEST) ? RX_DROP_NEWEST : RX_DROP_OLDEST;
+
+        // the ring is recreated on next init, it is not freed here as receive loops may still be reading it
+        rxRingChanged = true;
+    }
+    pthread_mutex_unlock(&owner_mutex);
+
+    return ret;
+}
+
+/*
+** set_radio_thread_config() - opt in to real-time scheduling for the radio owner thread
+**
+** priority is the SCHED_FIFO priority (1-99, 0 for normal scheduling), cpuMask the CPUs the thread may run on (bit n
+** for CPU n, 0 for any) and lockMem locks the process memory so that the radio thread is never paged out.  Applied
+** straight away if the radio is running, otherwise when it is initialised.
+**
+** returns 0, or the first setting that could not be applied (see _apply_thread_config)
+*/
+int set_radio_thread_config(int priority, unsigned int cpuMask, int lockMem)
+{
+    int ret = 0;
+    int max = sched_get_priority_max(SCHED_FIFO);
+
+    if (priority < 0)
+        priority = 0;
+    if (priority > max)
+        priority = max;
+
+    pthread_mutex_lock(&owner_mutex);
+    threadConfigured = true;
+    threadPriority = priority;
+    threadCpus = cpuMask;
+    threadLockMem = (lockMem != 0);
+    if (atomic_load(&running))
+        ret = _apply_thread_config(ownerThread);
+    pthread_mutex_unlock(&owner_mutex);
+
+    return ret;
+}
+
+/*
+** ener_malloc() / ener_calloc() - counted heap allocation, all addon allocations should go through these
+**
+** Nothing on the steady state Tx/Rx path allocates, the count reported by get_radio_stats() shows this holds
+*/
+void *ener_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&heapAllocs, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+void *ener_calloc(size_t nmemb, size_t size)
+{
+    atomic_fetch_add_explicit(&heapAllocs, 1, memory_order_relaxed);
+    return calloc(nmemb, size);
+}
+
+/*
+** get_radio_stats() - JSONify the radio counters into buf
+**
+** returns the length of the string, or -1 if buf is too small
+*/
+int get_radio_stats(char *buf, unsigned int buflen)
+{
+    struct DECODE_STATS decode;
+    struct RX_RING_STATS rx;
+    RADIO_TX_STATS tx;
+    HRF_STATS spi;
+    int len;
+
+    pthread_mutex_lock(&decodeMutex);
+    decode = decodeStats;
+    pthread_mutex_unlock(&decodeMutex);
+
+    rx_ring_stats(&rx);
+    radio_get_tx_stats(&tx);
+    HRF_get_stats(&spi);
+
+    len = snprintf(buf, buflen, "{\"rx\":{\"size\":%u,\"depth\":%u,\"enqueued\":%u,\"dropped\":%u,\"highWater\":%u,\"policy\":\"%s\"},"
+                   "\"tx\":{\"count\":%u,\"autoModes\":%u,\"blindLastUs\":%u,\"blindMaxUs\":%u,\"blindAvgUs\":%u,\"lastAirtimeUs\":%u,\"lastTxUs\":%u},"
+                   "\"drain\":{\"count\":%u,\"packets\":%u,\"bytes\":%u,\"discarded\":%u,\"missedEdges\":%u,\"irqPolling\":%s,\"lastPackets\":%u,\"lastBytes\":%u,\"maxPackets\":%u,\"lastUs\":%u,\"maxUs\":%u,\"avgUs\":%u},"
+                   "\"decode\":{\"count\":%u,\"depth\":%u,\"lastUs\":%u,\"maxUs\":%u,\"avgUs\":%u},"
+                   "\"spi\":{\"driver\":\"%s\",\"kbps\":%u,\"speedHz\":%u,\"xfers\":%u,\"batchedOps\":%u,\"writesSaved\":%u},\"heap\":{\"allocs\":%u},"
+                   "\"watchdog\":{\"checks\":%u,\"failures\":%u,\"recoveries\":%u,\"recoveryFailures\":%u,\"pollTimeouts\":%u,\"lastRecoveryUs\":%u,\"maxRecoveryUs\":%u},"
+                   "\"thread\":{\"priority\":%d,\"cpuMask\":%u,\"memLocked\":%s,\"result\":%d}}",
+                   rx.size, rx.depth, rx.enqueued, rx.dropped, rx.highWater,
+                   rx.policy == RX_DROP_NEWEST ? "newest" : "oldest",
+                   tx.count, tx.autoModes, tx.blindLastUs, tx.blindMaxUs,
+                   tx.blindCount ? (unsigned int)(tx.blindTotalUs / tx.blindCount) : 0,
+                   tx.lastAirtimeUs, tx.lastTxUs,
+                   drainStats.drains, drainStats.packets, drainStats.bytes, drainStats.discarded,
+                   drainStats.missedEdges, irqPolling ? "true" : "false",
+                   drainStats.lastPackets, drainStats.lastBytes, drainStats.maxPackets,
+                   drainStats.lastUs, drainStats.maxUs, drainStats.drains ? (unsigned int)(drainStats.totalUs / drainStats.drains) : 0,
+                   decode.count, rx.depth, decode.lastUs, decode.maxUs,
+                   decode.count ? (unsigned int)(decode.totalUs / decode.count) : 0,
+                   spi.hwDriver ? "spidev" : "software", spi.kbps, spi.speedHz, spi.xfers, spi.batchedOps, spi.writesSaved, atomic_load(&heapAllocs),
+                   watchdogStats.checks, watchdogStats.failures, watchdogStats.recoveries, watchdogStats.recoveryFailures,
+                   spi.pollTimeouts, watchdogStats.lastRecoveryUs, watchdogStats.maxRecoveryUs,
+                   threadPriority, threadCpus, memLocked ? "true" : "false", threadResult);
+
+    return (len < 0 || (unsigned int)len >= buflen) ? -1 : len;
+}
 
-    //printf("get_RxMsg(%d): %d\n", msgNum, (int)rxMsg->t);
+/*
+** rx_decoded() - called by a receive loop once it has decoded and dispatched a message from the ring
+**
+** Records the decode stage latency, i.e. how long the message waited in the ring plus the time taken to decode it
+*/
+void rx_decoded(const struct RADIO_MSG *rxMsg)
+{
+    struct timespec ts;
+    uint64_t nowNs;
+    uint32_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    nowNs = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    us = (nowNs > rxMsg->monoNs) ? (uint32_t)((nowNs - rxMsg->monoNs) / 1000) : 0;
+
+    pthread_mutex_lock(&decodeMutex);
+    decodeStats.count++;
+    decodeStats.lastUs = us;
+    decodeStats.totalUs += us;
+    if (us > decodeStats.maxUs)
+        decodeStats.maxUs = us;
+    pthread_mutex_unlock(&decodeMutex);
+}
 
-    return (int)rxMsg->t;
+/*
+** wake_radio_Rx() - wake everyone waiting in wait_radio_Rx(), so that receive loops re-check their state (stop
+** requests, new cached commands) immediately rather than at the end of their timeout
+*/
+void wake_radio_Rx(void)
+{
+    pthread_once(&eventFdsOnce, _create_event_fds);
+    _rx_notify();
+}
+
+/*
+** radio_rx_gen() - the current receive generation, to pass to wait_radio_Rx()
+**
+** Take this before checking the receive ring, so that anything stored after the check ends the wait straight away
+*/
+unsigned int radio_rx_gen(void)
+{
+    return atomic_load(&rxGen);
+}
+
+/*
+** wait_radio_Rx() - wait for the owner thread to store received messages after gen was taken, or for timeout_ms to
+** pass
+**
+** Whilst monitoring the owner thread drains the radio as soon as PayloadReady is raised (or every RADIO_RX_POLL_MS
+** without DIO0, with a safety drain every RADIO_RX_SAFETY_MS with it) and wakes us here, so the decoder never has to
+** empty the radio itself.  Every waiter is woken, not just one.
+**
+** returns 1 if woken, 0 on timeout, -1 if the radio has been closed
+*/
+int wait_radio_Rx(unsigned int timeout_ms, unsigned int gen)
+{
+    struct timespec deadline;
+    int ret = 0;
+
+    if (!running)
+        return -1;
+
+    pthread_once(&eventFdsOnce, _create_event_fds);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&rxWaitMutex);
+    while (atomic_load(&rxGen) == gen)
+    {
+        if (pthread_cond_timedwait(&rxWaitCond, &rxWaitMutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    if (atomic_load(&rxGen) != gen)
+        ret = running ? 1 : -1;
+    pthread_mutex_unlock(&rxWaitMutex);
+
+    return ret;
 }
 
 /*
 ** send_radio_msg() - transmits a given payload a number of times
 **
-** Use this function to perform a raw transmit with full locking and mode switching
+** Use this function to perform a raw transmit with full serialisation and mode switching
 ** Minimal checking is performed in this function
 */
 int send_radio_msg(unsigned char mod, unsigned char *payload, unsigned char len, unsigned char times)
@@ -298,16 +1013,11 @@ int send_radio_msg(unsigned char mod, unsigned char *payload, unsigned char len,
     #if defined(FULLTRACE)
         TRACE_OUTS("radio_mod_transmit(): called\n");
     #endif
-    
-    if (lock_ener314rt() == 0)
-    {
-        radio_mod_transmit(mod, payload, len, times);
-        ret = unlock_ener314rt();
-    }
-    else
+
+    if ((ret = radio_tx(mod, payload, len, times)) != 0)
     {
-        TRACE_OUTS("radio_mod_transmit(): couldn't get lock\n");
+        TRACE_OUTS("radio_mod_transmit(): radio unavailable\n");
         ret = -1;
     }
     return ret;
-}
\ No newline at end of file
+}
@@ -6,7 +6,9 @@
 #define _INIT_H
 
 #include <stdint.h>
-#include <pthread.h>
+#include <time.h>
+#include <stddef.h>
+#include <semaphore.h>
 
 
 // Radio constants (from radio.c)
@@ -17,24 +19,62 @@ enum deviceTypes{DT_CONTROL = 1, DT_MONITOR, DT_LEARN};
 
 // Rx Message
 struct RADIO_MSG {
-    time_t t;
+    time_t t;                           // wall clock time the message was read from the radio
+    uint64_t monoNs;                    // CLOCK_MONOTONIC time the message was read from the radio
+    uint32_t seq;                       // receive sequence number, increments for every message read
+    float rssi;                         // signal strength (dBm) at PayloadReady
+    int32_t afc;                        // AFC correction (Hz) applied by the radio
+    int32_t fei;                        // frequency error (Hz) measured by the radio
     unsigned char msg[MAX_FIFO_BUFFER];
 };
-#define RX_MSGS 5
+
+// Transmit result, see radio_last_tx()
+struct RADIO_TX_INFO {
+    uint32_t airtimeUs;                 // theoretical airtime of the transmit (all repeats)
+    uint32_t txUs;                      // time actually taken to send it
+    uint64_t doneNs;                    // CLOCK_MONOTONIC time the transmit completed
+};
+
+// Requests that can be made of the radio owner thread
+enum radioReqType{RRQ_INIT = 1, RRQ_CLOSE, RRQ_TX, RRQ_RX_DRAIN};
+
+// Radio request, allocated by the caller and linked into the owner thread's queue until it completes
+struct RADIO_REQ {
+    struct RADIO_REQ *_Atomic next;     // queue link, owned by the queue
+    enum radioReqType type;
+    // RRQ_TX
+    unsigned char mod;
+    unsigned char *payload;
+    unsigned char len;
+    unsigned char times;
+    struct RADIO_TX_INFO txInfo;        // filled in on completion
+    // RRQ_RX_DRAIN
+    enum deviceTypes rxMode;
+    // completion
+    int result;
+    sem_t done;
+};
 
 // function prototypes
 int init_ener314rt(int lock);
 void close_ener314rt(void);
-int lock_ener314rt(void);
-int unlock_ener314rt(void);
+int radio_submit(struct RADIO_REQ *req);
+int radio_tx(unsigned char mod, unsigned char *payload, unsigned char len, unsigned char times);
+void radio_last_tx(struct RADIO_TX_INFO *txInfo);
 int empty_radio_Rx_buffer(enum deviceTypes rxMode);
 int pop_RxMsg(struct RADIO_MSG *rxMsg);
 int get_RxMsg(int msgNum, struct RADIO_MSG *rxMsg);
+unsigned int radio_rx_gen(void);
+int wait_radio_Rx(unsigned int timeout_ms, unsigned int gen);
+void wake_radio_Rx(void);
+void rx_decoded(const struct RADIO_MSG *rxMsg);
+int set_rx_ring_config(unsigned int size, unsigned int dropPolicy);
+int set_radio_thread_config(int priority, unsigned int cpuMask, int lockMem);
+int get_radio_stats(char *buf, unsigned int buflen);
 int send_radio_msg(unsigned char mod, unsigned char *payload, unsigned char len, unsigned char times);
+void *ener_malloc(size_t size);
+void *ener_calloc(size_t nmemb, size_t size);
 
 #endif
 
-//globals
-//extern pthread_mutex_t radio_mutex;
-
 /***** END OF FILE *****/
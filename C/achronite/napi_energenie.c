@@ -1,14 +1,23 @@
 //#define NAPI_VERSION 3
+#define _GNU_SOURCE       // pthread_setname_np
 #define NAPI_EXPERIMENTAL // needed for threadsafe functions (Dec 2019)
+#define NODE_API_EXPERIMENTAL_NOGC_ENV_OPT_OUT // finalizers take a napi_env, as in the stable N-API
 #include <node_api.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "lock_radio.h"
 #include "openThings.h"
 #include "ook_send.h"
+#include "leds.h"
 #include "../energenie/trace.h"
 
 /*
@@ -41,15 +50,311 @@
 void xcb_openThings_receive(napi_env env, void *data);
 void ccb_openThings_receive(napi_env env, napi_status status, void *data);
 
+// Monitor message buffers, preallocated so that receiving does not touch the heap.  The monitor thread takes a free
+// buffer, fills it and adds it to the delivery queue, the js marshaller takes everything queued and returns the
+// buffers to the pool once the messages have been converted.  Each holds the decoded message, and its JSON unless
+// messages are being delivered as objects.
+#define MONITOR_POOL_SIZE 64
+#define MONITOR_BUFLEN    OT_MSG_JSONLEN
+#define MONITOR_BATCH_MAX 32            // most messages given to the callback in one array
+#define MONITOR_LINGER_MS 50            // default time a partly filled batch waits for more messages
+
+struct MONITOR_MSG
+{
+    struct OT_MSG ot;
+    char json[MONITOR_BUFLEN];
+};
+
+static struct MONITOR_MSG monitorPool[MONITOR_POOL_SIZE];
+static atomic_bool monitorPoolInUse[MONITOR_POOL_SIZE];
+static sem_t monitorPoolFree;
+static bool monitorPoolReady = false;
+
+// Delivery queue between the monitor thread and js.  It is bounded (at most MONITOR_POOL_SIZE - 1 so the monitor
+// thread always has a buffer to receive into) and when full the policy decides what happens: the monitor thread
+// waits for js (MQ_BLOCK), the oldest message is dropped (MQ_DROP_OLDEST), or a message replaces one still queued
+// for the same device, dropping the oldest if there is none (MQ_COALESCE).  Only one tsfn call (the 'doorbell') is
+// ever outstanding, the js marshaller takes everything queued when it runs.
+//
+// Each run of the monitor thread has its own queue, the context of its tsfn, so that messages queued by a run that
+// has been stopped are still delivered to its callback (with its settings) and never to the next run's.  The bound,
+// policy and counters are shared, as is the mutex.
+enum monitorQueuePolicy {MQ_BLOCK = 0, MQ_DROP_OLDEST, MQ_COALESCE};
+#define MONITOR_QUEUE_DEFAULT 48
+#define MONITOR_QUEUE_MAX     (MONITOR_POOL_SIZE - 1)
+
+struct ADDON_DATA;
+
+struct MONITOR_QUEUE
+{
+    struct MONITOR_MSG *msgs[MONITOR_POOL_SIZE]; // ring of queued messages
+    unsigned int deviceIds[MONITOR_POOL_SIZE];
+    unsigned int head, count;
+    bool doorbell;                      // a tsfn call is outstanding
+    uint64_t firstNs;                   // CLOCK_MONOTONIC time the oldest message was queued
+    // the run's settings, for the marshaller
+    struct ADDON_DATA *addon_data;
+    uint32_t batchSize;
+    bool objects;
+    unsigned int refs;                  // held by the run until its thread is joined, and by its tsfn (js thread only)
+};
+
+static struct
+{
+    pthread_mutex_t mutex;              // protects this and every MONITOR_QUEUE
+    pthread_cond_t space;               // signalled when js takes messages, or monitoring is stopped
+    unsigned int size;                  // queue bound
+    enum monitorQueuePolicy policy;
+    unsigned int depth;                 // messages queued, in all queues
+    // counters
+    uint32_t queued, delivered, dropped, coalesced, blocked, highWater, callbacks;
+} monitorQueue = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                  .space = PTHREAD_COND_INITIALIZER,
+                  .size = MONITOR_QUEUE_DEFAULT,
+                  .policy = MQ_BLOCK};
+
+static uint64_t _mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// returns a free buffer, or NULL if monitoring is stopped (*run cleared) whilst waiting for one.  Stopping posts an
+// extra token to wake us, which is put back here and removed again once the thread has been joined
+static struct MONITOR_MSG *monitor_buf_get(atomic_bool *run)
+{
+    int i;
+
+    while (sem_wait(&monitorPoolFree) != 0)
+        ;
+
+    if (!atomic_load(run))
+    {
+        sem_post(&monitorPoolFree);
+        return NULL;
+    }
+
+    // a buffer is free as we got past the semaphore, the monitor thread is the only taker so this always finds one
+    for (i = 0; i < MONITOR_POOL_SIZE; i++)
+    {
+        if (!atomic_exchange(&monitorPoolInUse[i], true))
+            return &monitorPool[i];
+    }
+    return NULL;
+}
+
+static void monitor_buf_put(struct MONITOR_MSG *buf)
+{
+    atomic_store(&monitorPoolInUse[buf - monitorPool], false);
+    sem_post(&monitorPoolFree);
+}
+
+static struct MONITOR_QUEUE *monitor_queue_new(struct ADDON_DATA *addon_data, uint32_t batchSize, bool objects)
+{
+    struct MONITOR_QUEUE *q = ener_calloc(1, sizeof(struct MONITOR_QUEUE));
+
+    if (q != NULL)
+    {
+        q->addon_data = addon_data;
+        q->batchSize = batchSize;
+        q->objects = objects;
+        q->refs = 2;
+    }
+    return q;
+}
+
+// drop a reference to a queue, the last returns anything left in it to the pool (js thread)
+static void monitor_queue_put_ref(struct MONITOR_QUEUE *q)
+{
+    if (--q->refs > 0)
+        return;
+
+    pthread_mutex_lock(&monitorQueue.mutex);
+    while (q->count > 0)
+    {
+        monitor_buf_put(q->msgs[q->head]);
+        q->head = (q->head + 1) % MONITOR_POOL_SIZE;
+        q->count--;
+        monitorQueue.depth--;
+        monitorQueue.dropped++;
+    }
+    pthread_mutex_unlock(&monitorQueue.mutex);
+    free(q);
+}
+
+// tsfn finalizer, the tsfn has made its last call into js
+static void monitor_queue_finalize(napi_env env, void *data, void *hint)
+{
+    (void)env;
+    (void)hint;
+    monitor_queue_put_ref((struct MONITOR_QUEUE *)data);
+}
+
+// add a message to the delivery queue (monitor thread), returns false if monitoring was stopped (or node is shutting
+// down) whilst waiting for room
+static bool monitor_queue_put(struct MONITOR_QUEUE *q, struct MONITOR_MSG *buf, atomic_bool *run,
+                              napi_threadsafe_function tsfn)
+{
+    unsigned int deviceId = buf->ot.deviceId, i, slot;
+    struct MONITOR_MSG *old;
+    bool waited = false;
+
+    pthread_mutex_lock(&monitorQueue.mutex);
+    if (monitorQueue.policy == MQ_COALESCE)
+    {
+        for (i = 0; i < q->count; i++)
+        {
+            slot = (q->head + i) % MONITOR_POOL_SIZE;
+            if (q->deviceIds[slot] == deviceId)
+            {
+                // replace the older message from this device, keeping its place in the queue
+                old = q->msgs[slot];
+                q->msgs[slot] = buf;
+                monitorQueue.coalesced++;
+                pthread_mutex_unlock(&monitorQueue.mutex);
+                monitor_buf_put(old);
+                return true;
+            }
+        }
+    }
+
+    while (q->count >= monitorQueue.size)
+    {
+        if (monitorQueue.policy == MQ_BLOCK)
+        {
+            if (!atomic_load(run))
+            {
+                pthread_mutex_unlock(&monitorQueue.mutex);
+                monitor_buf_put(buf);
+                return false;
+            }
+            if (!q->doorbell)
+            {
+                // js has not been called for these yet (the queue is smaller than the batch, or it filled within
+                // lingerMs), so call it now or nothing will ever make room
+                q->doorbell = true;
+                pthread_mutex_unlock(&monitorQueue.mutex);
+                if (napi_call_threadsafe_function(tsfn, NULL, napi_tsfn_blocking) != napi_ok)
+                {
+                    monitor_buf_put(buf);
+                    return false;
+                }
+                pthread_mutex_lock(&monitorQueue.mutex);
+                continue;
+            }
+            if (!waited)
+                monitorQueue.blocked++;
+            waited = true;
+            pthread_cond_wait(&monitorQueue.space, &monitorQueue.mutex);
+        }
+        else
+        {
+            monitor_buf_put(q->msgs[q->head]);
+            q->head = (q->head + 1) % MONITOR_POOL_SIZE;
+            q->count--;
+            monitorQueue.depth--;
+            monitorQueue.dropped++;
+        }
+    }
+
+    slot = (q->head + q->count) % MONITOR_POOL_SIZE;
+    q->msgs[slot] = buf;
+    q->deviceIds[slot] = deviceId;
+    if (q->count++ == 0)
+        q->firstNs = _mono_ns();
+    monitorQueue.depth++;
+    monitorQueue.queued++;
+    if (q->count > monitorQueue.highWater)
+        monitorQueue.highWater = q->count;
+    pthread_mutex_unlock(&monitorQueue.mutex);
+
+    return true;
+}
+
+// returns true, having set the doorbell, if js should be called to take the queued messages now (monitor thread).
+// Otherwise *dueNs is set to when they will be due, or 0 if there is nothing to wait for.
+static bool monitor_queue_due(struct MONITOR_QUEUE *q, uint32_t batchSize, uint32_t lingerMs, uint64_t *dueNs)
+{
+    bool due = false;
+
+    *dueNs = 0;
+    pthread_mutex_lock(&monitorQueue.mutex);
+    if (q->count > 0 && !q->doorbell)
+    {
+        *dueNs = q->firstNs + (uint64_t)lingerMs * 1000000ULL;
+        if (q->count >= batchSize || _mono_ns() >= *dueNs)
+        {
+            q->doorbell = true;
+            due = true;
+        }
+    }
+    pthread_mutex_unlock(&monitorQueue.mutex);
+
+    return due;
+}
+
+// take everything in the queue, making room for the monitor thread straight away (js thread).  Returns the count.
+static unsigned int monitor_queue_take(struct MONITOR_QUEUE *q, struct MONITOR_MSG **msgs)
+{
+    unsigned int count;
+
+    pthread_mutex_lock(&monitorQueue.mutex);
+    for (count = 0; count < q->count; count++)
+        msgs[count] = q->msgs[(q->head + count) % MONITOR_POOL_SIZE];
+    q->head = (q->head + count) % MONITOR_POOL_SIZE;
+    q->count = 0;
+    q->doorbell = false;
+    monitorQueue.depth -= count;
+    monitorQueue.delivered += count;
+    pthread_cond_broadcast(&monitorQueue.space);
+    pthread_mutex_unlock(&monitorQueue.mutex);
+
+    return count;
+}
+
 // monitor thread structure
-typedef struct
+typedef struct ADDON_DATA
 {
-    napi_async_work work;
+    pthread_t thread;
+    bool threadStarted;                 // thread is running or waiting to be joined (js thread only)
     napi_threadsafe_function tsfn;
-    bool monitor;
+    struct MONITOR_QUEUE *queue;        // delivery queue of the current run
+    atomic_bool monitor;
+    int stopFd;                         // eventfd signalled when monitoring is stopped
     uint32_t timeout;
+    uint32_t batchSize;                 // messages per callback, 1 = a string per message, >1 = arrays
+    uint32_t lingerMs;                  // longest a message waits for a batch to fill
+    bool objects;                       // deliver messages as objects rather than JSON strings
+    napi_ref keyTable;                  // array of the message field names, by key (js thread only)
+    // async transmits, see _queue_radio_tx()
+    napi_threadsafe_function txTsfn;
+    pthread_t txThread;
+    bool txThreadStarted;
+    bool txStop;
+    pthread_mutex_t txMutex;
+    pthread_cond_t txCond;
+    struct ASYNC_TX *txHead, *txTail;   // queue of transmits waiting for the transmit thread
+    unsigned int txOutstanding;         // transmits whose promise is unsettled (js thread only)
+    // async receives, see af_openThings_receive()
+    napi_threadsafe_function rxTsfn;
+    pthread_t rxThread;
+    bool rxThreadStarted;
+    bool rxStop;
+    pthread_mutex_t rxMutex;
+    pthread_cond_t rxCond;              // uses CLOCK_MONOTONIC
+    struct ASYNC_RX *rxPending;         // receives waiting for a message
+    uint32_t rxNextId;
+    unsigned int rxOutstanding;         // receives whose promise is unsettled (js thread only)
 } AddonData;
 
+static void _stop_tx_thread(AddonData *addon_data);
+static void _stop_rx_thread(AddonData *addon_data);
+static void _rx_publish(AddonData *addon_data, const struct MONITOR_MSG *msg);
+
+#define MONITOR_CLOSED_WAIT_MS 100      // how often the monitor thread checks if a closed radio has been reopened
+
 // ----------FILE--------- lock_radio.c
 
 /* N-API function (nf_) wrapper initEner314rt for:
@@ -240,6 +545,237 @@ napi_value nf_send_radio_msg(napi_env env, napi_callback_info info)
     return nv_ret;
 }
 
+/* N-API function (nf_) wrapper setRxBuffer for:
+**  int set_rx_ring_config(unsigned int size, unsigned int dropPolicy)
+**
+** Args
+**   0: unsigned int size - number of messages to buffer (rounded up to a power of 2)
+**   1: unsigned int dropPolicy - 0=drop oldest, 1=drop newest when full
+*/
+napi_value nf_set_rx_ring_config(napi_env env, napi_callback_info info)
+{
+    napi_status status;
+    size_t argc = 2; // 2 passed in args
+    napi_value argv[2];
+    napi_value nv_ret;
+    int ret = -10;
+    napi_valuetype type_of_argument;
+    uint32_t size = 0, dropPolicy = 0;
+
+    // get args
+    status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+    if (status != napi_ok)
+    {
+        // we cant recover from this error
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+    }
+    else
+    {
+        // 0: unsigned int size
+        status = napi_typeof(env, argv[0], &type_of_argument);
+        if (status != napi_ok || type_of_argument != napi_number)
+        {
+            napi_throw_type_error(env, NULL, "size not number");
+        }
+        else
+        {
+            status = napi_get_value_uint32(env, argv[0], &size);
+
+            if (status != napi_ok)
+                napi_throw_error(env, NULL, "Invalid size");
+        }
+
+        // 1: unsigned int dropPolicy (optional)
+        if (argc > 1)
+        {
+            status = napi_typeof(env, argv[1], &type_of_argument);
+            if (status != napi_ok || type_of_argument != napi_number)
+            {
+                napi_throw_type_error(env, NULL, "dropPolicy not number");
+            }
+            else
+            {
+                status = napi_get_value_uint32(env, argv[1], &dropPolicy);
+
+                if (status != napi_ok)
+                    napi_throw_error(env, NULL, "Invalid dropPolicy");
+            }
+        }
+
+        // Call C routine
+        ret = set_rx_ring_config(size, dropPolicy);
+    }
+
+    // convert return value into JS value
+    status = napi_create_int32(env, ret, &nv_ret);
+
+    if (status != napi_ok)
+    {
+        napi_throw_error(env, NULL, "Unable to create return value");
+    }
+
+    return nv_ret;
+}
+
+/* N-API function (nf_) wrapper setRadioThread for:
+**  int set_radio_thread_config(int priority, unsigned int cpuMask, int lockMem)
+**
+** Args
+**   0: int priority - SCHED_FIFO priority 1-99, 0=normal scheduling
+**   1: unsigned int cpuMask - CPUs the radio thread may run on, bit n for CPU n, 0=any (optional)
+**   2: bool lockMemory - lock process memory so the radio thread is not paged out (optional)
+*/
+napi_value nf_set_radio_thread_config(napi_env env, napi_callback_info info)
+{
+    napi_status status;
+    size_t argc = 3; // 3 passed in args
+    napi_value argv[3];
+    napi_value nv_ret;
+    int ret = -10;
+    napi_valuetype type_of_argument;
+    int32_t priority = 0;
+    uint32_t cpuMask = 0;
+    bool lockMem = false;
+
+    // get args
+    status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+    if (status != napi_ok)
+    {
+        // we cant recover from this error
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+    }
+    else
+    {
+        // 0: int priority
+        status = napi_typeof(env, argv[0], &type_of_argument);
+        if (status != napi_ok || type_of_argument != napi_number)
+        {
+            napi_throw_type_error(env, NULL, "priority not number");
+            return NULL;
+        }
+        status = napi_get_value_int32(env, argv[0], &priority);
+        if (status != napi_ok)
+        {
+            napi_throw_error(env, NULL, "Invalid priority");
+            return NULL;
+        }
+
+        // 1: unsigned int cpuMask (optional)
+        if (argc > 1)
+        {
+            status = napi_typeof(env, argv[1], &type_of_argument);
+            if (status != napi_ok || type_of_argument != napi_number)
+            {
+                napi_throw_type_error(env, NULL, "cpuMask not number");
+                return NULL;
+            }
+            status = napi_get_value_uint32(env, argv[1], &cpuMask);
+            if (status != napi_ok)
+            {
+                napi_throw_error(env, NULL, "Invalid cpuMask");
+                return NULL;
+            }
+        }
+
+        // 2: bool lockMemory (optional)
+        if (argc > 2)
+        {
+            status = napi_get_value_bool(env, argv[2], &lockMem);
+            if (status != napi_ok)
+            {
+                napi_throw_type_error(env, NULL, "lockMemory not boolean");
+                return NULL;
+            }
+        }
+
+        // Call C routine
+        ret = set_radio_thread_config(priority, cpuMask, lockMem);
+    }
+
+    // convert return value into JS value
+    status = napi_create_int32(env, ret, &nv_ret);
+
+    if (status != napi_ok)
+    {
+        napi_throw_error(env, NULL, "Unable to create return value");
+    }
+
+    return nv_ret;
+}
+
+/* N-API function (nf_) wrapper setLeds for:
+**  void leds_enable(int enabled)
+**
+** Args
+**   0: bool enabled - false to keep the Tx/Rx LEDs dark (headless installs)
+**
+** Returns the LED state now in force (always false if built with ENER314RT_NO_LEDS)
+*/
+napi_value nf_set_leds(napi_env env, napi_callback_info info)
+{
+    napi_status status;
+    size_t argc = 1;
+    napi_value argv[1];
+    napi_value nv_ret;
+    bool enabled = true;
+
+    status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+    if (status != napi_ok || argc < 1)
+    {
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+        return NULL;
+    }
+
+    status = napi_get_value_bool(env, argv[0], &enabled);
+    if (status != napi_ok)
+    {
+        napi_throw_type_error(env, NULL, "enabled not boolean");
+        return NULL;
+    }
+
+    leds_enable(enabled);
+
+    status = napi_get_boolean(env, leds_enabled(), &nv_ret);
+    if (status != napi_ok)
+    {
+        napi_throw_error(env, NULL, "Unable to create return value");
+    }
+
+    return nv_ret;
+}
+
+/* N-API function (nf_) wrapper getRadioStats for:
+**  int get_radio_stats(char *buf, unsigned int buflen)
+**
+** Returns the radio counters as a json string
+*/
+napi_value nf_get_radio_stats(napi_env env, napi_callback_info info)
+{
+    napi_status status;
+    napi_value nv_ret;
+    const int buflen = 2000;
+    char buf[buflen];
+
+    // Call C routine
+    if (get_radio_stats(buf, buflen) > 0)
+    {
+        status = napi_create_string_latin1(env, buf, NAPI_AUTO_LENGTH, &nv_ret);
+    }
+    else
+    {
+        status = napi_create_int32(env, -1, &nv_ret);
+    }
+
+    if (status != napi_ok)
+    {
+        napi_throw_error(env, NULL, "Unable to create return value");
+    }
+
+    return nv_ret;
+}
+
 // ----------FILE--------- openThings.c
 
 /* N-API function (nf_) wrapper openThingsSwitch for:
@@ -367,7 +903,7 @@ napi_value nf_openThings_deviceList(napi_env env, napi_callback_info info)
     //int ret;
     napi_valuetype type_of_argument;
 
-    // malloced in function
+    // static buffer returned by openThings_deviceList()
     char *buf = NULL;
 
     bool scan;
@@ -404,12 +940,15 @@ napi_value nf_openThings_deviceList(napi_env env, napi_callback_info info)
 
     //printf("nf_openThings_deviceList: 2 strlen = %d\n", strlen(buf));
 
+    if (buf == NULL)
+    {
+        napi_throw_error(env, NULL, "Device list truncated");
+        return NULL;
+    }
+
     // convert return buf string into JS value, ignore ret
     status = napi_create_string_latin1(env, buf, NAPI_AUTO_LENGTH, &nv_ret);
 
-    // free the malloced buffer from openThings_deviceList()
-    free(buf);
-
     if (status != napi_ok)
     {
         napi_throw_error(env, NULL, "Unable to create return value");
@@ -430,7 +969,7 @@ napi_value nf_openThings_receive(napi_env env, napi_callback_info info)
     size_t argc = 1; // 1 passed in arg
     napi_value argv[1];
     uint32_t timeout = 0;
-    const int buflen = 500;
+    const int buflen = OT_MSG_JSONLEN;
 
     char buf[buflen];
 
@@ -735,8 +1274,9 @@ napi_value nf_openThings_cache_cmd(napi_env env, napi_callback_info info)
 }
 
 /*
-** N-API Continuous monitoring thread version - this uses a continously executing async worker thread and 
-** utilises a threadsafe function to return the monitor messages back to javascript (node.js).
+** N-API Continuous monitoring thread version - this uses a dedicated monitor thread (rather than an async worker, which
+** would permanently occupy one of the libuv threadpool threads used by fs, dns and crypto) and utilises a threadsafe
+** function to return the monitor messages back to javascript (node.js).
 **
 ** This version was specifically designed to cope with the energenie thermostic radiator valves as they
 ** only have a small Rx window.
@@ -745,112 +1285,290 @@ napi_value nf_openThings_cache_cmd(napi_env env, napi_callback_info info)
 **
 */
 
-// This is the threadsafe function called from the worker thread.  It is responsible for converting data Rx by the worker
-// thread to napi_value items that can be passed into JavaScript, and for calling the JavaScript function
-// passed in by the parent
-static void tr_openThings_receive_thread(napi_env env, napi_value js_cb, void *context, void *data)
+// N-API Internal function - returns the array of message field names indexed by key (enum otMsgKey), creating them the
+// first time so that every message object shares the same key strings
+static napi_value _ot_key_table(napi_env env, AddonData *addon_data)
 {
-    // This parameter is not used.
-    (void)context;
-    //napi_status status;
-
-    // Retrieve the buffer from the item created by the worker thread.
-    char *buf = (char *)data;
+    napi_value table, key;
+    char name[OT_PARAM_NAME_LEN + 1];
+    int i, len;
 
-    //TRACE_OUTS("tr_openThings_receive_thread buf=");
-    //TRACE_OUTS(buf);
-
-    // env and js_cb may both be NULL if Node.js is in its cleanup phase, and
-    // items are left over from earlier thread-safe calls from the worker thread.
-    // When env is NULL, we simply skip over the call into Javascript and free the items.
-    if (env != NULL)
+    if (addon_data->keyTable != NULL)
     {
-        napi_value undefined, js_buf;
-
-        // Convert the buf to a napi_value string.
-        assert(napi_create_string_latin1(env, buf, NAPI_AUTO_LENGTH, &js_buf) == napi_ok);
-
-        // Retrieve the JavaScript `undefined` value so we can use it as the `this`
-        // value of the JavaScript function call.
-        assert(napi_get_undefined(env, &undefined) == napi_ok);
+        assert(napi_get_reference_value(env, addon_data->keyTable, &table) == napi_ok);
+        return table;
+    }
 
-        // Call the JavaScript callback function passing it the result in a buffer
-        assert(napi_call_function(env,
-                                  undefined,
-                                  js_cb,
-                                  1,
-                                  &js_buf,
-                                  NULL) == napi_ok);
+    assert(napi_create_array_with_length(env, OTK_COUNT, &table) == napi_ok);
+    for (i = 0; i < OTK_COUNT; i++)
+    {
+        if ((len = openThings_key_name(i, name, sizeof(name))) < 0)
+            len = snprintf(name, sizeof(name), "UNKNOWN");
+        assert(napi_create_string_latin1(env, name, len, &key) == napi_ok);
+        assert(napi_set_element(env, table, i, key) == napi_ok);
     }
+    assert(napi_create_reference(env, table, 1, &addon_data->keyTable) == napi_ok);
 
-    // Free the item created by the worker thread.
-    free(data);
+    return table;
+}
+
+// N-API Internal function - convert a decoded message into a js object, numbers are as JSON.parse() of its JSON gives
+static napi_value _ot_msg_object(napi_env env, napi_value keys, const struct OT_MSG *msg)
+{
+    napi_property_descriptor props[OT_MSG_MAX_FIELDS];
+    const struct OT_FIELD *field;
+    napi_value obj;
+    unsigned int i;
+
+    memset(props, 0, sizeof(props));
+    for (i = 0; i < msg->count; i++)
+    {
+        field = &msg->fields[i];
+        if (field->key == OTK_TEXT)
+            assert(napi_create_string_latin1(env, msg->text + field->name, NAPI_AUTO_LENGTH, &props[i].name) == napi_ok);
+        else
+            assert(napi_get_element(env, keys, field->key, &props[i].name) == napi_ok);
+
+        switch (field->type)
+        {
+        case OTF_INT:
+            assert(napi_create_int32(env, field->v.i, &props[i].value) == napi_ok);
+            break;
+        case OTF_STR:
+            assert(napi_create_string_latin1(env, msg->text + field->v.str, NAPI_AUTO_LENGTH, &props[i].value) == napi_ok);
+            break;
+        case OTF_BOOL:
+            assert(napi_get_boolean(env, field->v.b, &props[i].value) == napi_ok);
+            break;
+        default:
+            assert(napi_create_double(env, openThings_field_number(field), &props[i].value) == napi_ok);
+        }
+        props[i].attributes = napi_writable | napi_enumerable | napi_configurable;
+    }
+
+    assert(napi_create_object(env, &obj) == napi_ok);
+    assert(napi_define_properties(env, obj, msg->count, props) == napi_ok);
+
+    return obj;
+}
+
+// N-API Internal function - a monitor message as js, either an object or its JSON
+static napi_value _monitor_msg_value(napi_env env, napi_value keys, const struct MONITOR_MSG *msg)
+{
+    napi_value nv_msg;
+
+    if (keys != NULL)
+        return _ot_msg_object(env, keys, &msg->ot);
+
+    assert(napi_create_string_latin1(env, msg->json, NAPI_AUTO_LENGTH, &nv_msg) == napi_ok);
+    return nv_msg;
+}
+
+// This is the threadsafe function called from the worker thread.  It is responsible for converting data Rx by the worker
+// thread to napi_value items that can be passed into JavaScript, and for calling the JavaScript function
+// passed in by the parent
+static void tr_openThings_receive_thread(napi_env env, napi_value js_cb, void *context, void *data)
+{
+    struct MONITOR_QUEUE *q = (struct MONITOR_QUEUE *)context;
+    struct MONITOR_MSG *msgs[MONITOR_POOL_SIZE];
+    unsigned int count, i, j, n, batchSize;
+    (void)data;
+
+    // Take everything queued by the monitor thread run this tsfn belongs to, which may since have been stopped
+    count = monitor_queue_take(q, msgs);
+
+    // env and js_cb may both be NULL if Node.js is in its cleanup phase, and
+    // items are left over from earlier thread-safe calls from the worker thread.
+    // When env is NULL, we simply skip over the call into Javascript and free the items.
+    if (env != NULL)
+    {
+        napi_value undefined, js_buf, js_msg, keys = NULL;
+
+        // Retrieve the JavaScript `undefined` value so we can use it as the `this`
+        // value of the JavaScript function call.
+        assert(napi_get_undefined(env, &undefined) == napi_ok);
+
+        if (q->objects && count > 0)
+            keys = _ot_key_table(env, q->addon_data);
+
+        batchSize = q->batchSize;
+        for (i = 0; i < count; i += n)
+        {
+            if (batchSize > 1)
+            {
+                // Convert up to batchSize messages to an array, so that a burst costs one call into JavaScript
+                n = (count - i < batchSize) ? count - i : batchSize;
+                assert(napi_create_array_with_length(env, n, &js_buf) == napi_ok);
+                for (j = 0; j < n; j++)
+                {
+                    js_msg = _monitor_msg_value(env, keys, msgs[i + j]);
+                    assert(napi_set_element(env, js_buf, j, js_msg) == napi_ok);
+                }
+            }
+            else
+            {
+                // Convert the buf to a napi_value string (or object).
+                n = 1;
+                js_buf = _monitor_msg_value(env, keys, msgs[i]);
+            }
+
+            // Call the JavaScript callback function passing it the result in a buffer
+            assert(napi_call_function(env,
+                                      undefined,
+                                      js_cb,
+                                      1,
+                                      &js_buf,
+                                      NULL) == napi_ok);
+            monitorQueue.callbacks++;
+        }
+    }
+
+    // Return the buffers filled by the monitor thread to the pool.
+    for (i = 0; i < count; i++)
+        monitor_buf_put(msgs[i]);
 }
 
 // N-API Internal function - primary execution thread, runs Rx commands in a loop whilst monitoring is active
-// This function runs on a worker thread. It has no access to the JavaScript
-// environment except through the thread-safe function.
-static void tx_openThings_receive_thread(napi_env env, void *data)
+// This function runs on the monitor thread. It has no access to the JavaScript environment except through the
+// thread-safe function, the js thread holds the tsfn for us until it has joined this thread.
+static void *tx_openThings_receive_thread(void *data)
 {
     AddonData *addon_data = (AddonData *)data;
     int result;
-    //napi_status status;
+    struct MONITOR_MSG *buf = NULL;
+    uint64_t dueNs = 0, now;
+    uint32_t timeout;
 
     TRACE_OUTS("tx_openThings_receive_thread starting\n");
-    // We bracket the use of the thread-safe function by this thread by a call to
-    // napi_acquire_threadsafe_function() here, and by a call to
-    // napi_release_threadsafe_function() immediately prior to thread exit.
-    assert(napi_acquire_threadsafe_function(addon_data->tsfn) == napi_ok);
+    pthread_setname_np(pthread_self(), "ener314rt-mon");
 
-    // Call the receive in a monitor loop, calling the tsfn when we have recieved a valid message via the radio adaptor
-    addon_data->monitor = true;
-
-    // Call Rx in a loop until we are told to stop, this uses an async function so shouldnt block node.js
-    do
+    // Call Rx in a loop until we are told to stop, calling the tsfn when we have recieved a valid message via the radio adaptor
+    while (atomic_load(&addon_data->monitor))
     {
-        // Allocate the buffer from the heap. The JavaScript marshaller (tr_openThings_receive_thread)
-        // will free this item after having sent it to JavaScript.
-        char *buf = malloc(500 * sizeof(char));
+        // Take a buffer from the pool, the JavaScript marshaller (tr_openThings_receive_thread) returns it after
+        // having sent it to JavaScript.  If nothing is received we keep the buffer for the next loop.
+        if (buf == NULL && (buf = monitor_buf_get(&addon_data->monitor)) == NULL)
+            break;
+
+        // whilst a batch is filling only wait until it is due to be sent
+        timeout = addon_data->timeout;
+        if (dueNs != 0)
+        {
+            now = _mono_ns();
+            if (dueNs <= now)
+                timeout = 0;
+            else if ((dueNs - now) / 1000000 < timeout)
+                timeout = (uint32_t)((dueNs - now) / 1000000);
+        }
 
-        result = openThings_receive(buf, 500, addon_data->timeout);
+        result = openThings_receive_msg(&buf->ot, timeout);
         if (result > 0)
         {
-            // we have received a valid OpenThings message, call threadsafe function to notify js consumer
-            // this also frees the malloc'ed memory
-            assert(napi_call_threadsafe_function(addon_data->tsfn,
-                                                 buf,
-                                                 napi_tsfn_blocking) == napi_ok);
+            // we have received a valid OpenThings message, pass it to any openThingsReceiveAsync() waiting and
+            // queue it for the js consumer.  Objects are built by the marshaller straight from the decoded message.
+            if (buf->ot.truncated ||
+                (!addon_data->objects && openThings_msg_json(&buf->ot, buf->json, MONITOR_BUFLEN) < 0))
+            {
+                // never deliver a partial message, keep the buffer for the next message
+                TRACE_FAIL("tx_ monitor message truncated, dropped\n");
+            }
+            else
+            {
+                _rx_publish(addon_data, buf);
+                if (!monitor_queue_put(addon_data->queue, buf, &addon_data->monitor, addon_data->tsfn))
+                {
+                    buf = NULL;
+                    break;
+                }
+                buf = NULL;
+            }
+        }
+        else if (result == -3)
+        {
+            // radio has been closed, wait for it to be reopened or for monitoring to stop
+            struct pollfd pfd = {.fd = addon_data->stopFd, .events = POLLIN};
+            poll(&pfd, 1, MONITOR_CLOSED_WAIT_MS);
         }
         else
         {
-            // we need to free instead
             #if defined(FULLTRACE)        
                 TRACE_OUTS("*");
             #endif
-            free(buf);
         }
-    } while (addon_data->monitor);
 
-    // Indicate that monitoring is closing so there will be no further use of the thread-safe function.
-    assert(napi_release_threadsafe_function(addon_data->tsfn, napi_tsfn_release) == napi_ok);
+        // call threadsafe function to notify js consumer once a batch is full or has waited long enough
+        if (monitor_queue_due(addon_data->queue, addon_data->batchSize, addon_data->lingerMs, &dueNs) &&
+            napi_call_threadsafe_function(addon_data->tsfn, NULL, napi_tsfn_blocking) != napi_ok)
+        {
+            // node is shutting down
+            TRACE_OUTS("tx_ tsfn closing\n");
+            break;
+        }
+    }
+
+    // send anything still queued when monitoring is stopped
+    if (monitor_queue_due(addon_data->queue, 0, 0, &dueNs))
+        napi_call_threadsafe_function(addon_data->tsfn, NULL, napi_tsfn_blocking);
+
+    if (buf != NULL)
+        monitor_buf_put(buf);
+
     TRACE_OUTS("tx_ monitor thread completed\n");
+    return NULL;
 }
 
-// N-API Internal function - run when ts async function completes
-// This function runs on the main thread after `tx_openThings_receive_thread` completes (when monitoring is stopped).
-static void tc_openThings_receive_thread(napi_env env, napi_status status, void *data)
+// Stop the monitor thread and join it.  Wherever it is waiting (for a message, a free buffer or a closed radio to be
+// reopened) it is woken straight away rather than at the end of its timeout.
+static void _stop_monitor_thread(AddonData *addon_data)
 {
-    AddonData *addon_data = (AddonData *)data;
+    uint64_t count;
+    const uint64_t one = 1;
+
+    atomic_store(&addon_data->monitor, false);
+    sem_post(&monitorPoolFree);
+    pthread_mutex_lock(&monitorQueue.mutex);
+    pthread_cond_broadcast(&monitorQueue.space);
+    pthread_mutex_unlock(&monitorQueue.mutex);
+    if (write(addon_data->stopFd, &one, sizeof(one)) != sizeof(one))
+    {
+        TRACE_FAIL("monitor: eventfd write failed\n");
+    }
+    openThings_receive_wake();
+
+    pthread_join(addon_data->thread, NULL);
+    addon_data->threadStarted = false;
+    // anything still queued stays with the run's tsfn, which delivers it to its callback
+    monitor_queue_put_ref(addon_data->queue);
+    addon_data->queue = NULL;
+
+    // openThingsReceiveAsync() waiters now need to receive for themselves
+    pthread_mutex_lock(&addon_data->rxMutex);
+    pthread_cond_signal(&addon_data->rxCond);
+    pthread_mutex_unlock(&addon_data->rxMutex);
+
+    // remove the wake up token and reset the eventfd for the next run
+    while (sem_wait(&monitorPoolFree) != 0)
+        ;
+    if (read(addon_data->stopFd, &count, sizeof(count)) != sizeof(count))
+    {
+        TRACE_OUTS("monitor: stop eventfd already clear\n");
+    }
+}
+
+// N-API Internal function - stop the monitor thread and wait for it to finish, then release the thread-safe function.
+// This runs on the main thread; any messages already queued are still delivered to JavaScript before the tsfn is finalised.
+static void tc_openThings_receive_thread(AddonData *addon_data)
+{
+    if (!addon_data->threadStarted)
+        return;
 
     TRACE_OUTS("tc_ monitor thread closing...\n");
-    // Clean up the thread-safe function and the work item associated with this
-    // run.
+    _stop_monitor_thread(addon_data);
+
     assert(napi_release_threadsafe_function(addon_data->tsfn,
                                             napi_tsfn_release) == napi_ok);
-    assert(napi_delete_async_work(env, addon_data->work) == napi_ok);
 
-    // Set both values to NULL so JavaScript can order a new run of the thread.
-    addon_data->work = NULL;
+    // Set to NULL so JavaScript can order a new run of the thread.
     addon_data->tsfn = NULL;
 
     TRACE_OUTS("tc_ done\n");
@@ -863,18 +1581,21 @@ static void tc_openThings_receive_thread(napi_env env, napi_status status, void
 **
 ** This version creates a monitoring thread 
 **
-** Create a thread-safe function and an async queue work item. We pass the
-** thread-safe function to the async queue work item so that messages can be returned
-** into JavaScript from the worker thread on which the tx_openThings_receive_thread callback runs.
+** Create a thread-safe function and a monitor thread. We pass the thread-safe function to the
+** monitor thread so that messages can be returned into JavaScript from the thread on which
+** tx_openThings_receive_thread runs.
 **
 ** JS Input params:
 **  0: timeout
 **  1: callback
+**  2: batchSize (optional) - deliver up to this many messages per callback as an array, default 1 (a string per message)
+**  3: lingerMs (optional) - longest a message waits for a batch to fill, default 50ms
+**  4: objects (optional) - deliver each message as an object instead of a JSON string, default false
 */
 static napi_value tf_openThings_receive_thread(napi_env env, napi_callback_info info)
 {
-    size_t argc = 2;
-    napi_value argv[2];
+    size_t argc = 5;
+    napi_value argv[5];
     napi_value work_name;
     napi_status status;
     AddonData *addon_data;
@@ -890,7 +1611,7 @@ static napi_value tf_openThings_receive_thread(napi_env env, napi_callback_info
                             (void **)(&addon_data)) == napi_ok);
 
     // Ensure that the monitor thread isn't already in progress.
-    if (addon_data->work == NULL)
+    if (!addon_data->threadStarted)
     {
         // Ensure that the first argument 'wait' is a number
         napi_valuetype type_of_argument;
@@ -913,46 +1634,81 @@ static napi_value tf_openThings_receive_thread(napi_env env, napi_callback_info
                 addon_data->timeout = 5000;
             }
 
+            // 2, 3: batching
+            addon_data->batchSize = 1;
+            addon_data->lingerMs = MONITOR_LINGER_MS;
+            if (argc > 2 && napi_typeof(env, argv[2], &type_of_argument) == napi_ok && type_of_argument == napi_number)
+                napi_get_value_uint32(env, argv[2], &addon_data->batchSize);
+            if (argc > 3 && napi_typeof(env, argv[3], &type_of_argument) == napi_ok && type_of_argument == napi_number)
+                napi_get_value_uint32(env, argv[3], &addon_data->lingerMs);
+            if (addon_data->batchSize < 1)
+                addon_data->batchSize = 1;
+            if (addon_data->batchSize > MONITOR_BATCH_MAX)
+                addon_data->batchSize = MONITOR_BATCH_MAX;
+
+            // 4: message format
+            addon_data->objects = false;
+            if (argc > 4 && napi_typeof(env, argv[4], &type_of_argument) == napi_ok && type_of_argument == napi_boolean)
+                napi_get_value_bool(env, argv[4], &addon_data->objects);
+
             // Create a string to describe this asynchronous operation.
             assert(napi_create_string_utf8(env,
                                            "ener314rt:OTRxThread",
                                            NAPI_AUTO_LENGTH,
                                            &work_name) == napi_ok);
 
+            // This run's delivery queue, the context of its tsfn
+            addon_data->queue = monitor_queue_new(addon_data, addon_data->batchSize, addon_data->objects);
+            if (addon_data->queue == NULL)
+            {
+                napi_throw_error(env, NULL, "Unable to allocate monitor queue");
+                return NULL;
+            }
+
             // Convert the callback retrieved from JavaScript into a thread-safe function
             // which we can call from a worker thread.
             status = napi_create_threadsafe_function(env,
                                                      argv[1],
                                                      NULL,
                                                      work_name,
-                                                     0,
+                                                     1,     // only the doorbell is queued, see monitorQueue
                                                      1,
-                                                     NULL,
-                                                     NULL,
-                                                     NULL,
+                                                     addon_data->queue,
+                                                     monitor_queue_finalize,
+                                                     addon_data->queue,
                                                      tr_openThings_receive_thread,
                                                      &(addon_data->tsfn));
             if (status != napi_ok)
             {
                 TRACE_OUTN(status);
+                free(addon_data->queue);
+                addon_data->queue = NULL;
                 napi_throw_error(env, NULL, "Unable to create tsfn");
+                return NULL;
             }
             TRACE_OUTS("tf_ napi_create_threadsafe_function done\n");
 
-            // Create an async work item, passing in the addon data, which will give the
-            // worker thread access to the above-created thread-safe function.
-            assert(napi_create_async_work(env,
-                                          NULL,
-                                          work_name,
-                                          tx_openThings_receive_thread,
-                                          tc_openThings_receive_thread,
-                                          addon_data,
-                                          &(addon_data->work)) == napi_ok);
-
-            // Queue the work item for execution.
-            assert(napi_queue_async_work(env, addon_data->work) == napi_ok);
+            // Start the monitor thread, passing in the addon data, which will give the
+            // thread access to the above-created thread-safe function.
+            atomic_store(&addon_data->monitor, true);
+            // any openThingsReceiveAsync() receiving for itself hands over to the monitor thread
+            openThings_receive_wake();
+            if (pthread_create(&addon_data->thread, NULL, tx_openThings_receive_thread, addon_data) != 0)
+            {
+                assert(napi_release_threadsafe_function(addon_data->tsfn, napi_tsfn_release) == napi_ok);
+                addon_data->tsfn = NULL;
+                monitor_queue_put_ref(addon_data->queue);
+                addon_data->queue = NULL;
+                napi_throw_error(env, NULL, "Unable to create monitor thread");
+                return NULL;
+            }
+            addon_data->threadStarted = true;
             TRACE_OUTS("tf_ monitor thread started, timeout=");
             TRACE_OUTN(addon_data->timeout);
+            TRACE_OUTS(", batchSize=");
+            TRACE_OUTN(addon_data->batchSize);
+            TRACE_OUTS(", objects=");
+            TRACE_OUTN(addon_data->objects);
             TRACE_NL();
             // This causes `undefined` to be returned to JavaScript.
         }
@@ -971,15 +1727,27 @@ static void addon_getting_unloaded(napi_env env, void *data, void *hint)
     AddonData *addon_data = (AddonData *)data;
 
     TRACE_OUTS("addon_getting_unloaded>\n");
-    assert(addon_data->work == NULL &&
-           "No work item in progress at module unload");
+    if (addon_data->threadStarted)
+    {
+        // monitoring was never stopped, the tsfn is already being torn down by node so just wait for the thread
+        _stop_monitor_thread(addon_data);
+    }
+    close(addon_data->stopFd);
+    if (addon_data->keyTable != NULL)
+        napi_delete_reference(env, addon_data->keyTable);
+    _stop_tx_thread(addon_data);
+    _stop_rx_thread(addon_data);
+    pthread_mutex_destroy(&addon_data->rxMutex);
+    pthread_cond_destroy(&addon_data->rxCond);
+    pthread_mutex_destroy(&addon_data->txMutex);
+    pthread_cond_destroy(&addon_data->txCond);
     free(addon_data);
 }
 
 /* N-API function (nf_) stopMonitoring for:
 **  stop_monitoring()
 **
-** Calling this function notifies the monitor thread to close
+** Calling this function stops the monitor thread and waits for it to finish
 */
 static napi_value nf_stop_openThings_receive_thread(napi_env env, napi_callback_info info)
 {
@@ -997,12 +1765,135 @@ static napi_value nf_stop_openThings_receive_thread(napi_env env, napi_callback_
                             NULL,
                             (void **)(&addon_data)) == napi_ok);
 
-    // Ask monitor thread to stop
-    addon_data->monitor = false;
+    // Ask monitor thread to stop and join it
+    tc_openThings_receive_thread(addon_data);
 
     return 0;
 }
 
+/* N-API function (nf_) setMonitorQueue:
+**  bound the queue of monitor messages waiting for the openThingsReceiveThread callback, and choose what happens when
+**  it is full.  Can be called at any time.
+**
+** Args
+**   0: unsigned int size - messages queued (1-63, default 48)
+**   1: unsigned int policy - 0=block the monitor thread until js catches up (default), 1=drop the oldest message,
+**      2=replace a message still queued for the same device, otherwise drop the oldest (optional)
+**
+** returns the size in force, or -1 if the policy is invalid
+*/
+static napi_value nf_set_monitor_queue(napi_env env, napi_callback_info info)
+{
+    napi_status status;
+    size_t argc = 2; // 2 passed in args
+    napi_value argv[2];
+    napi_value nv_ret;
+    int ret = -10;
+    napi_valuetype type_of_argument;
+    uint32_t size = 0, policy = MQ_BLOCK;
+
+    // get args
+    status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+    if (status != napi_ok)
+    {
+        // we cant recover from this error
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+    }
+    else
+    {
+        // 0: unsigned int size
+        status = napi_typeof(env, argv[0], &type_of_argument);
+        if (status != napi_ok || type_of_argument != napi_number)
+        {
+            napi_throw_type_error(env, NULL, "size not number");
+        }
+        else
+        {
+            status = napi_get_value_uint32(env, argv[0], &size);
+
+            if (status != napi_ok)
+                napi_throw_error(env, NULL, "Invalid size");
+        }
+
+        // 1: unsigned int policy (optional)
+        if (argc > 1)
+        {
+            status = napi_typeof(env, argv[1], &type_of_argument);
+            if (status != napi_ok || type_of_argument != napi_number)
+            {
+                napi_throw_type_error(env, NULL, "policy not number");
+            }
+            else
+            {
+                status = napi_get_value_uint32(env, argv[1], &policy);
+
+                if (status != napi_ok)
+                    napi_throw_error(env, NULL, "Invalid policy");
+            }
+        }
+
+        if (policy > MQ_COALESCE)
+        {
+            ret = -1;
+        }
+        else
+        {
+            if (size < 1)
+                size = 1;
+            if (size > MONITOR_QUEUE_MAX)
+                size = MONITOR_QUEUE_MAX;
+
+            pthread_mutex_lock(&monitorQueue.mutex);
+            monitorQueue.size = size;
+            monitorQueue.policy = (enum monitorQueuePolicy)policy;
+            // a blocked monitor thread may now have room, or be able to drop instead
+            pthread_cond_broadcast(&monitorQueue.space);
+            pthread_mutex_unlock(&monitorQueue.mutex);
+            ret = (int)size;
+        }
+    }
+
+    // convert return value into JS value
+    status = napi_create_int32(env, ret, &nv_ret);
+
+    if (status != napi_ok)
+    {
+        napi_throw_error(env, NULL, "Unable to create return value");
+    }
+
+    return nv_ret;
+}
+
+/* N-API function (nf_) getMonitorStats:
+**  returns the monitor delivery queue counters as json
+*/
+static napi_value nf_get_monitor_stats(napi_env env, napi_callback_info info)
+{
+    static const char *policies[] = {"block", "oldest", "coalesce"};
+    napi_status status;
+    napi_value nv_ret;
+    char buf[400];
+    (void)info;
+
+    pthread_mutex_lock(&monitorQueue.mutex);
+    snprintf(buf, sizeof(buf), "{\"size\":%u,\"policy\":\"%s\",\"depth\":%u,\"highWater\":%u,\"queued\":%u,\"delivered\":%u,"
+             "\"dropped\":%u,\"coalesced\":%u,\"blocked\":%u,\"callbacks\":%u}",
+             monitorQueue.size, policies[monitorQueue.policy], monitorQueue.depth, monitorQueue.highWater,
+             monitorQueue.queued, monitorQueue.delivered, monitorQueue.dropped, monitorQueue.coalesced,
+             monitorQueue.blocked, monitorQueue.callbacks);
+    pthread_mutex_unlock(&monitorQueue.mutex);
+
+    status = napi_create_string_latin1(env, buf, NAPI_AUTO_LENGTH, &nv_ret);
+
+    if (status != napi_ok)
+    {
+        napi_throw_error(env, NULL, "Unable to create return value");
+    }
+
+    return nv_ret;
+}
+
 // ----------FILE--------- ook_send.c
 
 /* N-API function (nf_) wrapper ookSwitch for:
@@ -1113,103 +2004,1111 @@ napi_value nf_ook_switch(napi_env env, napi_callback_info info)
     return nv_ret;
 }
 
-// ----------------- END WRAPPERS -----------------------------
+// ----------ASYNC TRANSMIT---------
 
 /*
-** Initialise N-API functions and properties for the C library to be used from node.js / node-red
+** Promise based versions of the transmit functions (ookSwitchAsync, openThingsSwitchAsync, openThingsCmdAsync and
+** sendRadioMsgAsync).  The arguments are the same as the synchronous versions, which block the js thread for the
+** whole transmit (around 0.5s for 20 xmits).  Here the transmit is queued to a transmit thread, which passes it to
+** the radio owner thread and settles the promise through a threadsafe function.  Transmits are sent one at a time
+** by the radio anyway, so a single thread is used rather than occupying libuv threadpool workers whilst they wait.
+**
+** The promise is resolved with:
+**   {result, airtimeUs, txUs, txMonoUs}
+** where airtimeUs is the theoretical airtime of the transmit, txUs the time actually taken and txMonoUs the
+** monotonic time (as rxMonoUs in monitor messages) that the transmit completed.  A negative result rejects the
+** promise with an error whose 'code' is the result.  Invalid arguments throw, as the synchronous versions do.
 */
-napi_value Init(napi_env env, napi_value exports)
+enum asyncTxType {ATX_OOK_SWITCH = 1, ATX_OT_SWITCH, ATX_OT_CMD, ATX_RAW};
+
+struct ASYNC_TX
 {
-    napi_status status;
+    struct ASYNC_TX *next;              // transmit queue link
+    napi_deferred deferred;
+    enum asyncTxType type;
+    unsigned int zone, switchNum;       // ATX_OOK_SWITCH
+    unsigned int productId, deviceId;   // ATX_OT_SWITCH, ATX_OT_CMD
+    bool switchState;                   // ATX_OOK_SWITCH, ATX_OT_SWITCH
+    unsigned int command;               // ATX_OT_CMD
+    float data;
+    unsigned int mod;                   // ATX_RAW, the payload is copied as the js buffer may change before we send it
+    unsigned char payload[UINT8_MAX];
+    size_t len;
+    unsigned int xmits;
+    // results
+    int result;
+    struct RADIO_TX_INFO txInfo;
+};
 
-    TRACE_OUTS("napi_energenie.Init() called\n");
+// get a number argument, throwing a type error and returning false if it is not one
+static bool _get_uint32_arg(napi_env env, napi_value arg, const char *name, uint32_t *value)
+{
+    napi_valuetype type_of_argument;
+    char msg[40];
 
-    // Define addon-level data associated with tsfn
-    AddonData *addon_data = (AddonData *)malloc(sizeof(*addon_data));
-    addon_data->work = NULL;
+    if (napi_typeof(env, arg, &type_of_argument) != napi_ok || type_of_argument != napi_number ||
+        napi_get_value_uint32(env, arg, value) != napi_ok)
+    {
+        snprintf(msg, sizeof(msg), "%s not number", name);
+        napi_throw_type_error(env, NULL, msg);
+        return false;
+    }
+    return true;
+}
 
-    // Export all functions to allow javascript calls, just by using something like ener314rt.<function>()
-    //
-    // Method taken from: https://github.com/1995parham/Napi101/blob/master/src/bye.c
-    // This allows all functions to be defined in 1 go, replacing napi_create_function() & napi_set_named_property() calls
-    //
-    napi_property_descriptor props[] = {
-        {.utf8name = "initEner314rt",
-         .method = nf_init_ener314rt,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = NULL},
-        {.utf8name = "closeEner314rt",
-         .method = nf_close_ener314rt,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = NULL},
-        {.utf8name = "openThingsSwitch",
-         .method = nf_openThings_switch,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = NULL},
-        {.utf8name = "openThingsDeviceList",
-         .method = nf_openThings_deviceList,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = NULL},
-        {.utf8name = "openThingsReceive",
-         .method = nf_openThings_receive,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = NULL},
-        {.utf8name = "openThingsCmd",
-         .method = nf_openThings_cmd,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = NULL},
-        {.utf8name = "openThingsCacheCmd",
-         .method = nf_openThings_cache_cmd,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = NULL},
-        {.utf8name = "openThingsReceiveThread",
-         .method = tf_openThings_receive_thread,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = addon_data}, // note need to pass data
-        {.utf8name = "stopMonitoring",
-         .method = nf_stop_openThings_receive_thread,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = addon_data},
-        {.utf8name = "ookSwitch",
-         .method = nf_ook_switch,
-         .getter = NULL,
-         .setter = NULL,
-         .value = NULL,
-         .attributes = napi_default,
-         .data = NULL},
+static bool _get_bool_arg(napi_env env, napi_value arg, const char *name, bool *value)
+{
+    napi_valuetype type_of_argument;
+    char msg[40];
+
+    if (napi_typeof(env, arg, &type_of_argument) != napi_ok || type_of_argument != napi_boolean ||
+        napi_get_value_bool(env, arg, value) != napi_ok)
+    {
+        snprintf(msg, sizeof(msg), "%s not boolean", name);
+        napi_throw_type_error(env, NULL, msg);
+        return false;
+    }
+    return true;
+}
+
+// N-API Internal function - transmit thread, carries out queued transmits one at a time.  It has no access to the
+// JavaScript environment except through the thread-safe function, which settles each promise.
+static void *tx_radio_tx_thread(void *data)
+{
+    AddonData *addon_data = (AddonData *)data;
+    struct ASYNC_TX *tx;
+
+    pthread_setname_np(pthread_self(), "ener314rt-tx");
+
+    for (;;)
+    {
+        pthread_mutex_lock(&addon_data->txMutex);
+        while (addon_data->txHead == NULL && !addon_data->txStop)
+            pthread_cond_wait(&addon_data->txCond, &addon_data->txMutex);
+        tx = addon_data->txStop ? NULL : addon_data->txHead;
+        if (tx != NULL && (addon_data->txHead = tx->next) == NULL)
+            addon_data->txTail = NULL;
+        pthread_mutex_unlock(&addon_data->txMutex);
+
+        if (tx == NULL)
+            break;
+
+        switch (tx->type)
+        {
+        case ATX_OOK_SWITCH:
+            tx->result = ook_switch(tx->zone, tx->switchNum, tx->switchState, tx->xmits);
+            break;
+        case ATX_OT_SWITCH:
+            tx->result = openThings_switch(tx->productId, tx->deviceId, tx->switchState, tx->xmits);
+            break;
+        case ATX_OT_CMD:
+            tx->result = openThings_cmd(tx->productId, tx->deviceId, tx->command, tx->data, tx->xmits);
+            break;
+        case ATX_RAW:
+            tx->result = send_radio_msg(tx->mod, tx->payload, tx->len, tx->xmits);
+            break;
+        default:
+            tx->result = -1;
+        }
+        radio_last_tx(&tx->txInfo);
+
+        if (napi_call_threadsafe_function(addon_data->txTsfn, tx, napi_tsfn_blocking) != napi_ok)
+        {
+            // node is shutting down, the promise can no longer be settled
+            free(tx);
+        }
+    }
+
+    TRACE_OUTS("tx_radio_tx_thread completed\n");
+    return NULL;
+}
+
+// N-API Internal function - runs on the main thread once a transmit is complete, settles its promise
+static void tr_radio_tx(napi_env env, napi_value js_cb, void *context, void *data)
+{
+    AddonData *addon_data = (AddonData *)context;
+    struct ASYNC_TX *tx = (struct ASYNC_TX *)data;
+    napi_value nv_ret, nv_val;
+    (void)js_cb;
+
+    if (env != NULL)
+    {
+        if (tx->result < 0)
+        {
+            napi_create_string_utf8(env, "Transmit failed", NAPI_AUTO_LENGTH, &nv_val);
+            napi_create_error(env, NULL, nv_val, &nv_ret);
+            napi_create_int32(env, tx->result, &nv_val);
+            napi_set_named_property(env, nv_ret, "code", nv_val);
+            napi_reject_deferred(env, tx->deferred, nv_ret);
+        }
+        else
+        {
+            napi_create_object(env, &nv_ret);
+            napi_create_int32(env, tx->result, &nv_val);
+            napi_set_named_property(env, nv_ret, "result", nv_val);
+            napi_create_uint32(env, tx->txInfo.airtimeUs, &nv_val);
+            napi_set_named_property(env, nv_ret, "airtimeUs", nv_val);
+            napi_create_uint32(env, tx->txInfo.txUs, &nv_val);
+            napi_set_named_property(env, nv_ret, "txUs", nv_val);
+            // microseconds so that it is exactly representable as a js number
+            napi_create_double(env, (double)(tx->txInfo.doneNs / 1000), &nv_val);
+            napi_set_named_property(env, nv_ret, "txMonoUs", nv_val);
+            napi_resolve_deferred(env, tx->deferred, nv_ret);
+        }
+
+        // let node exit once nothing is waiting to be sent
+        if (--addon_data->txOutstanding == 0)
+            napi_unref_threadsafe_function(env, addon_data->txTsfn);
+    }
+
+    free(tx);
+}
+
+// queue tx on the transmit thread (starting it if need be) and return its promise, tx is freed when it completes
+static napi_value _queue_radio_tx(napi_env env, AddonData *addon_data, struct ASYNC_TX *tx)
+{
+    napi_value promise, work_name;
+
+    if (addon_data->txTsfn == NULL)
+    {
+        assert(napi_create_string_utf8(env, "ener314rt:TxThread", NAPI_AUTO_LENGTH, &work_name) == napi_ok);
+        if (napi_create_threadsafe_function(env, NULL, NULL, work_name, 0, 1, NULL, NULL, addon_data,
+                                            tr_radio_tx, &addon_data->txTsfn) != napi_ok)
+        {
+            free(tx);
+            addon_data->txTsfn = NULL;
+            napi_throw_error(env, NULL, "Unable to create tsfn");
+            return NULL;
+        }
+        napi_unref_threadsafe_function(env, addon_data->txTsfn);
+    }
+
+    if (!addon_data->txThreadStarted)
+    {
+        addon_data->txStop = false;
+        if (pthread_create(&addon_data->txThread, NULL, tx_radio_tx_thread, addon_data) != 0)
+        {
+            free(tx);
+            napi_throw_error(env, NULL, "Unable to create transmit thread");
+            return NULL;
+        }
+        addon_data->txThreadStarted = true;
+    }
+
+    if (napi_create_promise(env, &tx->deferred, &promise) != napi_ok)
+    {
+        free(tx);
+        napi_throw_error(env, NULL, "Unable to create promise");
+        return NULL;
+    }
+
+    if (addon_data->txOutstanding++ == 0)
+        napi_ref_threadsafe_function(env, addon_data->txTsfn);
+
+    tx->next = NULL;
+    pthread_mutex_lock(&addon_data->txMutex);
+    if (addon_data->txTail != NULL)
+        addon_data->txTail->next = tx;
+    else
+        addon_data->txHead = tx;
+    addon_data->txTail = tx;
+    pthread_cond_signal(&addon_data->txCond);
+    pthread_mutex_unlock(&addon_data->txMutex);
+
+    return promise;
+}
+
+// Stop the transmit thread, transmits that have not been started are abandoned
+static void _stop_tx_thread(AddonData *addon_data)
+{
+    struct ASYNC_TX *tx;
+
+    if (!addon_data->txThreadStarted)
+        return;
+
+    pthread_mutex_lock(&addon_data->txMutex);
+    addon_data->txStop = true;
+    pthread_cond_signal(&addon_data->txCond);
+    pthread_mutex_unlock(&addon_data->txMutex);
+    pthread_join(addon_data->txThread, NULL);
+    addon_data->txThreadStarted = false;
+
+    while ((tx = addon_data->txHead) != NULL)
+    {
+        addon_data->txHead = tx->next;
+        free(tx);
+    }
+    addon_data->txTail = NULL;
+}
+
+static struct ASYNC_TX *_new_radio_tx(napi_env env, enum asyncTxType type)
+{
+    struct ASYNC_TX *tx = ener_calloc(1, sizeof(struct ASYNC_TX));
+
+    if (tx == NULL)
+        napi_throw_error(env, NULL, "Out of memory");
+    else
+        tx->type = type;
+    return tx;
+}
+
+/* N-API function (af_) wrapper ookSwitchAsync for ook_switch(), returns a Promise
+**
+** Args: as ookSwitch
+*/
+static napi_value af_ook_switch(napi_env env, napi_callback_info info)
+{
+    size_t argc = 4;
+    napi_value argv[4];
+    struct ASYNC_TX *tx;
+    AddonData *addon_data;
+
+    if (napi_get_cb_info(env, info, &argc, argv, NULL, (void **)(&addon_data)) != napi_ok || argc < 4)
+    {
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+        return NULL;
+    }
+
+    if ((tx = _new_radio_tx(env, ATX_OOK_SWITCH)) == NULL)
+        return NULL;
+
+    if (!_get_uint32_arg(env, argv[0], "Zone", &tx->zone) ||
+        !_get_uint32_arg(env, argv[1], "SwitchNum", &tx->switchNum) ||
+        !_get_bool_arg(env, argv[2], "SwitchState", &tx->switchState) ||
+        !_get_uint32_arg(env, argv[3], "xmits", &tx->xmits))
+    {
+        free(tx);
+        return NULL;
+    }
+
+    return _queue_radio_tx(env, addon_data, tx);
+}
+
+/* N-API function (af_) wrapper openThingsSwitchAsync for openThings_switch(), returns a Promise
+**
+** Args: as openThingsSwitch
+*/
+static napi_value af_openThings_switch(napi_env env, napi_callback_info info)
+{
+    size_t argc = 4;
+    napi_value argv[4];
+    struct ASYNC_TX *tx;
+    AddonData *addon_data;
+
+    if (napi_get_cb_info(env, info, &argc, argv, NULL, (void **)(&addon_data)) != napi_ok || argc < 4)
+    {
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+        return NULL;
+    }
+
+    if ((tx = _new_radio_tx(env, ATX_OT_SWITCH)) == NULL)
+        return NULL;
+
+    if (!_get_uint32_arg(env, argv[0], "ProductId", &tx->productId) ||
+        !_get_uint32_arg(env, argv[1], "DeviceId", &tx->deviceId) ||
+        !_get_bool_arg(env, argv[2], "SwitchState", &tx->switchState) ||
+        !_get_uint32_arg(env, argv[3], "xmits", &tx->xmits))
+    {
+        free(tx);
+        return NULL;
+    }
+
+    return _queue_radio_tx(env, addon_data, tx);
+}
+
+/* N-API function (af_) wrapper openThingsCmdAsync for openThings_cmd(), returns a Promise
+**
+** Args: as openThingsCmd
+*/
+static napi_value af_openThings_cmd(napi_env env, napi_callback_info info)
+{
+    size_t argc = 5;
+    napi_value argv[5];
+    napi_valuetype type_of_argument;
+    double dData = 0;
+    struct ASYNC_TX *tx;
+    AddonData *addon_data;
+
+    if (napi_get_cb_info(env, info, &argc, argv, NULL, (void **)(&addon_data)) != napi_ok || argc < 5)
+    {
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+        return NULL;
+    }
+
+    if ((tx = _new_radio_tx(env, ATX_OT_CMD)) == NULL)
+        return NULL;
+
+    if (!_get_uint32_arg(env, argv[0], "ProductId", &tx->productId) ||
+        !_get_uint32_arg(env, argv[1], "DeviceId", &tx->deviceId) ||
+        !_get_uint32_arg(env, argv[2], "Command", &tx->command) ||
+        !_get_uint32_arg(env, argv[4], "xmits", &tx->xmits))
+    {
+        free(tx);
+        return NULL;
+    }
+
+    // 3: data, a float
+    if (napi_typeof(env, argv[3], &type_of_argument) != napi_ok || type_of_argument != napi_number ||
+        napi_get_value_double(env, argv[3], &dData) != napi_ok)
+    {
+        free(tx);
+        napi_throw_type_error(env, NULL, "Data not number");
+        return NULL;
+    }
+    tx->data = (float)dData;
+
+    return _queue_radio_tx(env, addon_data, tx);
+}
+
+/* N-API function (af_) wrapper sendRadioMsgAsync for send_radio_msg(), returns a Promise
+**
+** Args: as sendRadioMsg
+*/
+static napi_value af_send_radio_msg(napi_env env, napi_callback_info info)
+{
+    size_t argc = 3;
+    napi_value argv[3];
+    bool isBuffer = false;
+    unsigned char *msg;
+    size_t len = 0;
+    struct ASYNC_TX *tx;
+    AddonData *addon_data;
+
+    if (napi_get_cb_info(env, info, &argc, argv, NULL, (void **)(&addon_data)) != napi_ok || argc < 3)
+    {
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+        return NULL;
+    }
+
+    if ((tx = _new_radio_tx(env, ATX_RAW)) == NULL)
+        return NULL;
+
+    if (!_get_uint32_arg(env, argv[0], "modulation", &tx->mod) ||
+        !_get_uint32_arg(env, argv[1], "xmits", &tx->xmits))
+    {
+        free(tx);
+        return NULL;
+    }
+
+    // 2: payload, copied as the js buffer can be reused before the transmit happens
+    if (napi_is_buffer(env, argv[2], &isBuffer) != napi_ok || !isBuffer ||
+        napi_get_buffer_info(env, argv[2], (void **)(&msg), &len) != napi_ok)
+    {
+        free(tx);
+        napi_throw_error(env, NULL, "Message not a buffer");
+        return NULL;
+    }
+    if (len > sizeof(tx->payload))
+    {
+        free(tx);
+        napi_throw_range_error(env, NULL, "Message too long");
+        return NULL;
+    }
+    memcpy(tx->payload, msg, len);
+    tx->len = len;
+
+    return _queue_radio_tx(env, addon_data, tx);
+}
+
+// ----------ASYNC RECEIVE---------
+
+/*
+** Promise based version of openThingsReceive: openThingsReceiveAsync(timeout, signal)
+**
+** The promise resolves with the next valid OpenThings message (json, as openThingsReceive), or null if none arrives
+** within timeout ms.  signal is optional and may be an AbortSignal (anything with 'aborted' and
+** addEventListener('abort')); aborting rejects the promise with an AbortError.
+**
+** Receives never compete with the monitor thread for the receive ring.  Whilst monitoring, every receive waiting is
+** given a copy of the next message the monitor thread decodes (which is still passed to the monitor callback as
+** well).  Otherwise a receive thread calls openThings_receive() on their behalf, and every receive waiting is given
+** the message it returns.  Either way nothing blocks the js thread.
+*/
+enum asyncRxState {ARX_WAITING = 0, ARX_RECEIVED, ARX_TIMEOUT, ARX_ABORTED, ARX_FAILED};
+
+// context of an abort listener, freed once the listener has been garbage collected and the receive has finished
+struct ASYNC_RX_ABORT
+{
+    AddonData *addon_data;              // NULL once the addon is unloaded
+    uint32_t id;
+    unsigned int refs;                  // held by the listener's finalizer and the receive (js thread only)
+};
+
+struct ASYNC_RX
+{
+    struct ASYNC_RX *next;              // pending list link
+    uint32_t id;                        // used by the abort listener to find us, as we may be freed before it runs
+    napi_deferred deferred;
+    uint64_t deadlineNs;                // CLOCK_MONOTONIC
+    enum asyncRxState state;
+    int result;
+    // abort listener, removed from the signal when the receive finishes (js thread only)
+    struct ASYNC_RX_ABORT *abort;
+    napi_ref signal, listener;
+    char msg[MONITOR_BUFLEN];
+};
+
+static void _remove_receive_abort(napi_env env, struct ASYNC_RX *rx);
+static void _drop_receive_abort(struct ASYNC_RX *rx);
+
+// give msg to every receive waiting, called with rxMutex held
+static void _rx_publish_locked(AddonData *addon_data, const char *msg, int result)
+{
+    struct ASYNC_RX *rx;
+
+    for (rx = addon_data->rxPending; rx != NULL; rx = rx->next)
+    {
+        if (rx->state == ARX_WAITING)
+        {
+            strncpy(rx->msg, msg, MONITOR_BUFLEN - 1);
+            rx->msg[MONITOR_BUFLEN - 1] = '\0';
+            rx->result = result;
+            rx->state = ARX_RECEIVED;
+        }
+    }
+    pthread_cond_signal(&addon_data->rxCond);
+}
+
+// monitor thread - pass a decoded message to any receives waiting, as JSON
+static void _rx_publish(AddonData *addon_data, const struct MONITOR_MSG *msg)
+{
+    char json[MONITOR_BUFLEN];
+
+    pthread_mutex_lock(&addon_data->rxMutex);
+    if (addon_data->rxPending != NULL)
+    {
+        if (addon_data->objects)
+        {
+            if (openThings_msg_json(&msg->ot, json, sizeof(json)) >= 0)
+                _rx_publish_locked(addon_data, json, 1);
+        }
+        else
+            _rx_publish_locked(addon_data, msg->json, 1);
+    }
+    pthread_mutex_unlock(&addon_data->rxMutex);
+}
+
+// N-API Internal function - receive thread, completes receives that are waiting with a message, on timeout or abort.
+// The promises are settled through the thread-safe function.
+static void *tx_openThings_receive_async(void *data)
+{
+    AddonData *addon_data = (AddonData *)data;
+    struct ASYNC_RX *rx, **prx, *done;
+    char buf[MONITOR_BUFLEN];
+    uint64_t now, deadline;
+    struct timespec ts;
+    int ret;
+
+    pthread_setname_np(pthread_self(), "ener314rt-rx");
+
+    pthread_mutex_lock(&addon_data->rxMutex);
+    while (!addon_data->rxStop)
+    {
+        if (addon_data->rxPending == NULL)
+        {
+            pthread_cond_wait(&addon_data->rxCond, &addon_data->rxMutex);
+            continue;
+        }
+
+        // wait until the earliest deadline for a message
+        deadline = UINT64_MAX;
+        for (rx = addon_data->rxPending; rx != NULL; rx = rx->next)
+        {
+            if (rx->state == ARX_WAITING && rx->deadlineNs < deadline)
+                deadline = rx->deadlineNs;
+        }
+
+        if (deadline != UINT64_MAX)
+        {
+            if (atomic_load(&addon_data->monitor))
+            {
+                // the monitor thread passes us its messages
+                ts.tv_sec = (time_t)(deadline / 1000000000ULL);
+                ts.tv_nsec = (long)(deadline % 1000000000ULL);
+                pthread_cond_timedwait(&addon_data->rxCond, &addon_data->rxMutex, &ts);
+            }
+            else
+            {
+                now = _mono_ns();
+                pthread_mutex_unlock(&addon_data->rxMutex);
+                ret = openThings_receive(buf, MONITOR_BUFLEN, deadline > now ? (unsigned int)((deadline - now) / 1000000) : 0);
+                pthread_mutex_lock(&addon_data->rxMutex);
+                if (ret > 0)
+                {
+                    _rx_publish_locked(addon_data, buf, ret);
+                }
+                else if (ret == -3)
+                {
+                    // radio closed, fail everything waiting
+                    for (rx = addon_data->rxPending; rx != NULL; rx = rx->next)
+                    {
+                        if (rx->state == ARX_WAITING)
+                        {
+                            rx->result = ret;
+                            rx->state = ARX_FAILED;
+                        }
+                    }
+                }
+            }
+        }
+
+        // take every receive that has finished off the pending list
+        now = _mono_ns();
+        done = NULL;
+        prx = &addon_data->rxPending;
+        while ((rx = *prx) != NULL)
+        {
+            if (rx->state == ARX_WAITING && now >= rx->deadlineNs)
+                rx->state = ARX_TIMEOUT;
+
+            if (rx->state != ARX_WAITING)
+            {
+                *prx = rx->next;
+                rx->next = done;
+                done = rx;
+            }
+            else
+                prx = &rx->next;
+        }
+
+        pthread_mutex_unlock(&addon_data->rxMutex);
+        while ((rx = done) != NULL)
+        {
+            done = rx->next;
+            if (napi_call_threadsafe_function(addon_data->rxTsfn, rx, napi_tsfn_blocking) != napi_ok)
+                free(rx);
+        }
+        pthread_mutex_lock(&addon_data->rxMutex);
+    }
+    pthread_mutex_unlock(&addon_data->rxMutex);
+
+    TRACE_OUTS("tx_openThings_receive_async completed\n");
+    return NULL;
+}
+
+// N-API Internal function - runs on the main thread once a receive has finished, settles its promise
+static void tr_openThings_receive_async(napi_env env, napi_value js_cb, void *context, void *data)
+{
+    AddonData *addon_data = (AddonData *)context;
+    struct ASYNC_RX *rx = (struct ASYNC_RX *)data;
+    napi_value nv_ret, nv_val;
+    (void)js_cb;
+
+    if (env != NULL)
+    {
+        _remove_receive_abort(env, rx);
+
+        switch (rx->state)
+        {
+        case ARX_RECEIVED:
+            napi_create_string_latin1(env, rx->msg, NAPI_AUTO_LENGTH, &nv_ret);
+            napi_resolve_deferred(env, rx->deferred, nv_ret);
+            break;
+        case ARX_ABORTED:
+            napi_create_string_utf8(env, "ABORT_ERR", NAPI_AUTO_LENGTH, &nv_val);
+            napi_create_string_utf8(env, "The operation was aborted", NAPI_AUTO_LENGTH, &nv_ret);
+            napi_create_error(env, nv_val, nv_ret, &nv_ret);
+            napi_create_string_utf8(env, "AbortError", NAPI_AUTO_LENGTH, &nv_val);
+            napi_set_named_property(env, nv_ret, "name", nv_val);
+            napi_reject_deferred(env, rx->deferred, nv_ret);
+            break;
+        case ARX_FAILED:
+            napi_create_string_utf8(env, "Receive failed", NAPI_AUTO_LENGTH, &nv_val);
+            napi_create_error(env, NULL, nv_val, &nv_ret);
+            napi_create_int32(env, rx->result, &nv_val);
+            napi_set_named_property(env, nv_ret, "code", nv_val);
+            napi_reject_deferred(env, rx->deferred, nv_ret);
+            break;
+        default:
+            napi_get_null(env, &nv_ret);
+            napi_resolve_deferred(env, rx->deferred, nv_ret);
+        }
+
+        // let node exit once nothing is waiting for a message
+        if (--addon_data->rxOutstanding == 0)
+            napi_unref_threadsafe_function(env, addon_data->rxTsfn);
+    }
+    else
+        _drop_receive_abort(rx);
+
+    free(rx);
+}
+
+// N-API Internal function - abort listener added to the AbortSignal passed to openThingsReceiveAsync()
+static napi_value nf_openThings_receive_abort(napi_env env, napi_callback_info info)
+{
+    struct ASYNC_RX_ABORT *abort;
+    struct ASYNC_RX *rx;
+
+    if (napi_get_cb_info(env, info, NULL, NULL, NULL, (void **)(&abort)) != napi_ok || abort->addon_data == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&abort->addon_data->rxMutex);
+    for (rx = abort->addon_data->rxPending; rx != NULL; rx = rx->next)
+    {
+        if (rx->id == abort->id && rx->state == ARX_WAITING)
+        {
+            rx->state = ARX_ABORTED;
+            pthread_cond_signal(&abort->addon_data->rxCond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&abort->addon_data->rxMutex);
+
+    // end a receive in progress on the receive thread, the monitor loop simply carries on
+    if (rx != NULL)
+        openThings_receive_wake();
+
+    return NULL;
+}
+
+static void _put_receive_abort(struct ASYNC_RX_ABORT *abort)
+{
+    if (--abort->refs == 0)
+        free(abort);
+}
+
+static void _free_receive_abort(napi_env env, void *data, void *hint)
+{
+    (void)env;
+    (void)hint;
+    _put_receive_abort((struct ASYNC_RX_ABORT *)data);
+}
+
+// let go of the abort listener of rx without touching js (node is shutting down or the addon is being unloaded), it
+// can no longer find the addon
+static void _drop_receive_abort(struct ASYNC_RX *rx)
+{
+    if (rx->abort == NULL)
+        return;
+
+    rx->abort->addon_data = NULL;
+    _put_receive_abort(rx->abort);
+    rx->abort = NULL;
+}
+
+// remove the abort listener of rx from its signal, so that a signal reused for many receives does not collect them
+static void _remove_receive_abort(napi_env env, struct ASYNC_RX *rx)
+{
+    napi_value signal = NULL, listener = NULL, remove, args[2], nv_err;
+    napi_valuetype type;
+    bool pending = false;
+
+    if (rx->abort == NULL)
+        return;
+
+    if (napi_get_reference_value(env, rx->signal, &signal) == napi_ok && signal != NULL &&
+        napi_get_reference_value(env, rx->listener, &listener) == napi_ok && listener != NULL &&
+        napi_get_named_property(env, signal, "removeEventListener", &remove) == napi_ok &&
+        napi_typeof(env, remove, &type) == napi_ok && type == napi_function)
+    {
+        napi_create_string_utf8(env, "abort", NAPI_AUTO_LENGTH, &args[0]);
+        args[1] = listener;
+        napi_call_function(env, signal, remove, 2, args, NULL);
+    }
+
+    // the promise is still settled if the signal misbehaves
+    if (napi_is_exception_pending(env, &pending) == napi_ok && pending)
+        napi_get_and_clear_last_exception(env, &nv_err);
+
+    napi_delete_reference(env, rx->signal);
+    napi_delete_reference(env, rx->listener);
+    _put_receive_abort(rx->abort);
+    rx->abort = NULL;
+}
+
+// add an abort listener for rx to signal, returns false (with an exception pending) if it cannot be added
+static bool _add_receive_abort(napi_env env, AddonData *addon_data, napi_value signal, struct ASYNC_RX *rx)
+{
+    struct ASYNC_RX_ABORT *abort;
+    napi_value add, args[3], nv_val;
+    napi_valuetype type;
+
+    if (napi_get_named_property(env, signal, "addEventListener", &add) != napi_ok ||
+        napi_typeof(env, add, &type) != napi_ok || type != napi_function)
+    {
+        napi_throw_type_error(env, NULL, "signal is not an AbortSignal");
+        return false;
+    }
+
+    if ((abort = malloc(sizeof(*abort))) == NULL)
+    {
+        napi_throw_error(env, NULL, "Out of memory");
+        return false;
+    }
+    abort->addon_data = addon_data;
+    abort->id = rx->id;
+    abort->refs = 1;
+
+    napi_create_string_utf8(env, "abort", NAPI_AUTO_LENGTH, &args[0]);
+    if (napi_create_function(env, "abort", NAPI_AUTO_LENGTH, nf_openThings_receive_abort, abort, &args[1]) != napi_ok ||
+        napi_add_finalizer(env, args[1], abort, _free_receive_abort, NULL, NULL) != napi_ok)
+    {
+        free(abort);
+        napi_throw_error(env, NULL, "Unable to create abort listener");
+        return false;
+    }
+
+    // keep hold of the listener so that it can be removed when the receive finishes
+    if (napi_create_reference(env, signal, 1, &rx->signal) != napi_ok ||
+        napi_create_reference(env, args[1], 1, &rx->listener) != napi_ok)
+    {
+        if (rx->signal != NULL)
+            napi_delete_reference(env, rx->signal);
+        napi_throw_error(env, NULL, "Unable to create abort listener");
+        return false;
+    }
+    rx->abort = abort;
+    abort->refs++;
+
+    napi_create_object(env, &args[2]);
+    napi_get_boolean(env, true, &nv_val);
+    napi_set_named_property(env, args[2], "once", nv_val);
+
+    if (napi_call_function(env, signal, add, 3, args, NULL) != napi_ok)
+    {
+        _remove_receive_abort(env, rx);
+        return false;
+    }
+
+    return true;
+}
+
+// Stop the receive thread, receives that are waiting are abandoned
+static void _stop_rx_thread(AddonData *addon_data)
+{
+    struct ASYNC_RX *rx;
+
+    if (!addon_data->rxThreadStarted)
+        return;
+
+    pthread_mutex_lock(&addon_data->rxMutex);
+    addon_data->rxStop = true;
+    pthread_cond_signal(&addon_data->rxCond);
+    pthread_mutex_unlock(&addon_data->rxMutex);
+    openThings_receive_wake();
+    pthread_join(addon_data->rxThread, NULL);
+    addon_data->rxThreadStarted = false;
+
+    while ((rx = addon_data->rxPending) != NULL)
+    {
+        addon_data->rxPending = rx->next;
+        _drop_receive_abort(rx);
+        free(rx);
+    }
+}
+
+/* N-API function (af_) wrapper openThingsReceiveAsync for openThings_receive(), returns a Promise
+**
+** Args:
+**   0: timeout (ms)
+**   1: signal (optional) - AbortSignal
+*/
+static napi_value af_openThings_receive(napi_env env, napi_callback_info info)
+{
+    size_t argc = 2;
+    napi_value argv[2], promise, work_name, nv_val;
+    napi_valuetype type = napi_undefined;
+    AddonData *addon_data;
+    struct ASYNC_RX *rx;
+    uint32_t timeout;
+    bool aborted = false;
+
+    if (napi_get_cb_info(env, info, &argc, argv, NULL, (void **)(&addon_data)) != napi_ok || argc < 1)
+    {
+        napi_throw_error(env, NULL, "Failed to parse arguments");
+        return NULL;
+    }
+
+    if (!_get_uint32_arg(env, argv[0], "timeout", &timeout))
+        return NULL;
+
+    if (argc > 1 && napi_typeof(env, argv[1], &type) != napi_ok)
+        type = napi_undefined;
+
+    if (addon_data->rxTsfn == NULL)
+    {
+        assert(napi_create_string_utf8(env, "ener314rt:RxAsync", NAPI_AUTO_LENGTH, &work_name) == napi_ok);
+        if (napi_create_threadsafe_function(env, NULL, NULL, work_name, 0, 1, NULL, NULL, addon_data,
+                                            tr_openThings_receive_async, &addon_data->rxTsfn) != napi_ok)
+        {
+            addon_data->rxTsfn = NULL;
+            napi_throw_error(env, NULL, "Unable to create tsfn");
+            return NULL;
+        }
+        napi_unref_threadsafe_function(env, addon_data->rxTsfn);
+    }
+
+    if (!addon_data->rxThreadStarted)
+    {
+        addon_data->rxStop = false;
+        if (pthread_create(&addon_data->rxThread, NULL, tx_openThings_receive_async, addon_data) != 0)
+        {
+            napi_throw_error(env, NULL, "Unable to create receive thread");
+            return NULL;
+        }
+        addon_data->rxThreadStarted = true;
+    }
+
+    if ((rx = ener_calloc(1, sizeof(struct ASYNC_RX))) == NULL)
+    {
+        napi_throw_error(env, NULL, "Out of memory");
+        return NULL;
+    }
+    rx->id = ++addon_data->rxNextId;
+    rx->deadlineNs = _mono_ns() + (uint64_t)timeout * 1000000ULL;
+    rx->state = ARX_WAITING;
+
+    // 1: signal, abort straight away if it has already been aborted
+    if (type == napi_object)
+    {
+        if (napi_get_named_property(env, argv[1], "aborted", &nv_val) == napi_ok)
+            napi_get_value_bool(env, nv_val, &aborted);
+        if (aborted)
+            rx->state = ARX_ABORTED;
+        else if (!_add_receive_abort(env, addon_data, argv[1], rx))
+        {
+            free(rx);
+            return NULL;
+        }
+    }
+    else if (type != napi_undefined && type != napi_null)
+    {
+        free(rx);
+        napi_throw_type_error(env, NULL, "signal is not an AbortSignal");
+        return NULL;
+    }
+
+    if (napi_create_promise(env, &rx->deferred, &promise) != napi_ok)
+    {
+        free(rx);
+        napi_throw_error(env, NULL, "Unable to create promise");
+        return NULL;
+    }
+
+    if (addon_data->rxOutstanding++ == 0)
+        napi_ref_threadsafe_function(env, addon_data->rxTsfn);
+
+    pthread_mutex_lock(&addon_data->rxMutex);
+    rx->next = addon_data->rxPending;
+    addon_data->rxPending = rx;
+    pthread_cond_signal(&addon_data->rxCond);
+    pthread_mutex_unlock(&addon_data->rxMutex);
+
+    // a receive already in progress on the receive thread has a later deadline, restart it with ours
+    if (!atomic_load(&addon_data->monitor))
+        openThings_receive_wake();
+
+    return promise;
+}
+
+// ----------------- END WRAPPERS -----------------------------
+
+/*
+** Initialise N-API functions and properties for the C library to be used from node.js / node-red
+*/
+napi_value Init(napi_env env, napi_value exports)
+{
+    napi_status status;
+    pthread_condattr_t condattr;
+
+    TRACE_OUTS("napi_energenie.Init() called\n");
+
+    // Define addon-level data associated with tsfn
+    AddonData *addon_data = (AddonData *)ener_malloc(sizeof(*addon_data));
+    addon_data->threadStarted = false;
+    addon_data->tsfn = NULL;
+    atomic_init(&addon_data->monitor, false);
+    addon_data->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    addon_data->batchSize = 1;
+    addon_data->objects = false;
+    addon_data->keyTable = NULL;
+    addon_data->lingerMs = MONITOR_LINGER_MS;
+    addon_data->txTsfn = NULL;
+    addon_data->txThreadStarted = false;
+    addon_data->txStop = false;
+    pthread_mutex_init(&addon_data->txMutex, NULL);
+    pthread_cond_init(&addon_data->txCond, NULL);
+    addon_data->txHead = addon_data->txTail = NULL;
+    addon_data->txOutstanding = 0;
+    addon_data->rxTsfn = NULL;
+    addon_data->rxThreadStarted = false;
+    addon_data->rxStop = false;
+    pthread_mutex_init(&addon_data->rxMutex, NULL);
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&addon_data->rxCond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    addon_data->rxPending = NULL;
+    addon_data->rxNextId = 0;
+    addon_data->rxOutstanding = 0;
+
+    // monitor message buffers, shared by all instances of the addon
+    if (!monitorPoolReady)
+    {
+        sem_init(&monitorPoolFree, 0, MONITOR_POOL_SIZE);
+        monitorPoolReady = true;
+    }
+
+    // Export all functions to allow javascript calls, just by using something like ener314rt.<function>()
+    //
+    // Method taken from: https://github.com/1995parham/Napi101/blob/master/src/bye.c
+    // This allows all functions to be defined in 1 go, replacing napi_create_function() & napi_set_named_property() calls
+    //
+    napi_property_descriptor props[] = {
+        {.utf8name = "initEner314rt",
+         .method = nf_init_ener314rt,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "closeEner314rt",
+         .method = nf_close_ener314rt,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "openThingsSwitch",
+         .method = nf_openThings_switch,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "openThingsDeviceList",
+         .method = nf_openThings_deviceList,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "openThingsReceive",
+         .method = nf_openThings_receive,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "openThingsCmd",
+         .method = nf_openThings_cmd,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "openThingsCacheCmd",
+         .method = nf_openThings_cache_cmd,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "openThingsReceiveThread",
+         .method = tf_openThings_receive_thread,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = addon_data}, // note need to pass data
+        {.utf8name = "stopMonitoring",
+         .method = nf_stop_openThings_receive_thread,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = addon_data},
+        {.utf8name = "setMonitorQueue",
+         .method = nf_set_monitor_queue,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "getMonitorStats",
+         .method = nf_get_monitor_stats,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "ookSwitch",
+         .method = nf_ook_switch,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
         {.utf8name = "sendRadioMsg",
          .method = nf_send_radio_msg,
          .getter = NULL,
          .setter = NULL,
          .value = NULL,
          .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "setRxBuffer",
+         .method = nf_set_rx_ring_config,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "setRadioThread",
+         .method = nf_set_radio_thread_config,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "setLeds",
+         .method = nf_set_leds,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = NULL},
+        {.utf8name = "openThingsReceiveAsync",
+         .method = af_openThings_receive,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = addon_data},
+        {.utf8name = "ookSwitchAsync",
+         .method = af_ook_switch,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = addon_data},
+        {.utf8name = "openThingsSwitchAsync",
+         .method = af_openThings_switch,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = addon_data},
+        {.utf8name = "openThingsCmdAsync",
+         .method = af_openThings_cmd,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = addon_data},
+        {.utf8name = "sendRadioMsgAsync",
+         .method = af_send_radio_msg,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
+         .data = addon_data},
+        {.utf8name = "getRadioStats",
+         .method = nf_get_radio_stats,
+         .getter = NULL,
+         .setter = NULL,
+         .value = NULL,
+         .attributes = napi_default,
          .data = NULL}};
 
     // This method allows definition of multiple properties on a given object 'exports'
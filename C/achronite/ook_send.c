@@ -127,20 +127,8 @@ int ook_switch(unsigned int iZone, unsigned int iSwitchNum, unsigned char bSwitc
         radio_msg[INDEX_SC + 1] += 6;
     }
 
-    // lock adaptor
-    if ((ret = lock_ener314rt()) == 0)
-    {
-        /*
-        ** flush Rx buffer if required
-        */
-        ret = empty_radio_Rx_buffer(DT_CONTROL);
-
-        // Transmit OOK encoded payload 26ms per payload * xmits
-        radio_mod_transmit(RADIO_MODULATION_OOK, radio_msg, OOK_MSGLEN, xmits);
-
-        //unlock adaptor
-        unlock_ener314rt();
-    };
+    // Transmit OOK encoded payload 26ms per payload * xmits, the radio owner flushes the Rx buffer first if required
+    ret = radio_tx(RADIO_MODULATION_OOK, radio_msg, OOK_MSGLEN, xmits);
 
     return ret;
 }
\ No newline at end of file
@@ -6,8 +6,11 @@
 #include <sys/time.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include "openThings.h"
 #include "lock_radio.h"
+#include "rx_ring.h"
+#include "json_writer.h"
 #include "../energenie/radio.h"
 #include "../energenie/hrfm69.h"
 #include "../energenie/trace.h"
@@ -101,6 +104,7 @@ struct OT_DEVICE g_OTdevices[MAX_DEVICES]; // TODO: should maybe make this dynam
 static volatile int g_NumDevices = 0;      // number of auto-discovered OpenThings devices
 static volatile int g_CachedCmds = 0;      // number of eTRV devices with commands waiting to be sent to them (controls Rx loop behaviour)
 static volatile int g_PreCachedCmds = 0;   // for caching commands before device discovered
+static atomic_uint g_RxWakeups = 0;        // incremented by openThings_receive_wake(), ends any openThings_receive() waiting
 
 // declare and initialise cached count lock for multi-threading
 pthread_mutex_t cachedcount_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -109,6 +113,7 @@ pthread_mutex_t cachedcount_mutex = PTHREAD_MUTEX_INITIALIZER;
 static void _update_cachedcmd_count(int delta, bool isCached);
 static int _openThings_build_msg(unsigned char iProductId, unsigned int iDeviceId, unsigned char iCommand, float fData, unsigned char *radio_msg);
 static int _openThings_build_record(unsigned char iCommand, float fData, unsigned char *sRecord);
+static void _update_signal(int OTdi, const struct RADIO_MSG *rxMsg);
 
 /*
 ** calculateCRC()- Calculate an OpenThings CRC
@@ -277,6 +282,7 @@ int openThings_devicePut(unsigned int iDeviceId, unsigned char mfrId, unsigned c
         g_OTdevices[OTdi].productId = productId;
         g_OTdevices[OTdi].deviceId = iDeviceId;
         g_OTdevices[OTdi].joined = joined;
+        memset(&g_OTdevices[OTdi].signal, 0, sizeof(struct OT_SIGNAL));
 
         // add product characteristics
         OTpi = openThings_getProductIndex(productId);
@@ -287,7 +293,7 @@ int openThings_devicePut(unsigned int iDeviceId, unsigned char mfrId, unsigned c
         if (g_OTdevices[OTdi].control == 2)
         {
             TRACE_OUTS("openThings_devicePut() adding cache cmd struct.\n");
-            g_OTdevices[OTdi].cache = malloc(sizeof(struct CACHED_CMD));
+            g_OTdevices[OTdi].cache = ener_malloc(sizeof(struct CACHED_CMD));
             if (g_OTdevices[OTdi].cache != NULL)
             {
                 // malloc OK, set defaults for cached device
@@ -302,7 +308,7 @@ int openThings_devicePut(unsigned int iDeviceId, unsigned char mfrId, unsigned c
         if (productId == PRODUCTID_MIHO013)
         {
             TRACE_OUTS("openThings_devicePut() adding trv struct.\n");
-            g_OTdevices[OTdi].trv = malloc(sizeof(struct TRV_DEVICE));
+            g_OTdevices[OTdi].trv = ener_malloc(sizeof(struct TRV_DEVICE));
             if (g_OTdevices[OTdi].trv != NULL)
             {
                 // malloc OK, set defaults for trv
@@ -323,7 +329,7 @@ int openThings_devicePut(unsigned int iDeviceId, unsigned char mfrId, unsigned c
         else if (productId == PRODUCTID_MIHO069)
         {
             TRACE_OUTS("openThings_devicePut() adding thermostat struct.\n");
-            g_OTdevices[OTdi].thermostat = malloc(sizeof(struct STAT_DEVICE));
+            g_OTdevices[OTdi].thermostat = ener_malloc(sizeof(struct STAT_DEVICE));
             if (g_OTdevices[OTdi].thermostat != NULL)
             {
                 // malloc OK, set defaults
@@ -355,6 +361,34 @@ int openThings_devicePut(unsigned int iDeviceId, unsigned char mfrId, unsigned c
     return OTdi;
 }
 
+/*
+** _update_signal() - add the signal quality of a received message to the device's rolling aggregates
+*/
+void _update_signal(int OTdi, const struct RADIO_MSG *rxMsg)
+{
+    struct OT_SIGNAL *sig = &g_OTdevices[OTdi].signal;
+
+    if (sig->count == 0)
+    {
+        sig->rssiAvg = sig->rssiMin = sig->rssiMax = rxMsg->rssi;
+        sig->feiAvg = rxMsg->fei;
+    }
+    else
+    {
+        sig->rssiAvg += (rxMsg->rssi - sig->rssiAvg) / (1 << OT_SIGNAL_EWMA_SHIFT);
+        sig->feiAvg += (rxMsg->fei - sig->feiAvg) / (1 << OT_SIGNAL_EWMA_SHIFT);
+        if (rxMsg->rssi < sig->rssiMin)
+            sig->rssiMin = rxMsg->rssi;
+        if (rxMsg->rssi > sig->rssiMax)
+            sig->rssiMax = rxMsg->rssi;
+    }
+
+    sig->rssi = rxMsg->rssi;
+    sig->afc = rxMsg->afc;
+    sig->fei = rxMsg->fei;
+    sig->count++;
+}
+
 /*
 ** openThings_decode()
 ** ===================
@@ -472,14 +506,17 @@ int openThings_decode(unsigned char *payload, unsigned char *mfrId, unsigned cha
                 if (recs[record].cmd){
                     // record is a command from the gateway or another instance 
                     sprintf(recs[record].paramName, "_%s",  OTparams[paramIndex].paramName);
+                    recs[record].key = OTK_COMMAND_BASE + paramIndex;
                 } else {
                     strncpy(recs[record].paramName, OTparams[paramIndex].paramName, OT_PARAM_NAME_LEN);
+                    recs[record].key = paramIndex;
                 }
             }
             else
             {
                 // unknown parameter
                 sprintf(recs[record].paramName, "UNKNOWN_0x%2x", recs[record].paramId);
+                recs[record].key = OTK_TEXT;
             }
 
             // TYPE/LEN
@@ -649,30 +686,15 @@ int openThings_switch(unsigned char iProductId, unsigned int iDeviceId, unsigned
     cryptMsg(CRYPT_PID, pip, &radio_msg[5], (OTS_MSGLEN - 5));
 
     /*
-    ** Stage 2: Empty Rx buffer if required
+    ** Stage 2: Empty Rx buffer if required and Stage 3: Transmit via radio adaptor, both on the radio owner thread
     */
-
-    // mutex access radio adaptor to set mode
-    if ((ret = lock_ener314rt()) != 0)
+    // #32 - Do not return the record count
+    // Transmit encoded payload 26ms per payload * xmits
+    if ((ret = radio_tx(RADIO_MODULATION_FSK, radio_msg, OTS_MSGLEN, xmits)) != 0)
     {
-        TRACE_FAIL("openthings_switch(): error getting lock\n");
+        TRACE_FAIL("openthings_switch(): radio unavailable\n");
         return -1;
     }
-    else
-    {
-        // #32 - Do not return the record count
-        empty_radio_Rx_buffer(DT_CONTROL);
-        // printf("openThings_switch(%d): Rx_Buffer ", recs);
-
-        /*
-        ** Stage 3: Transmit via radio adaptor, using mutex to block the radio
-        */
-        // Transmit encoded payload 26ms per payload * xmits
-        radio_mod_transmit(RADIO_MODULATION_FSK, radio_msg, OTS_MSGLEN, xmits);
-
-        // release mutex lock
-        unlock_ener314rt();
-    }
 
     return ret;
 }
@@ -810,18 +832,15 @@ int openThings_cmd(unsigned char iProductId, unsigned int iDeviceId, unsigned ch
         msglen = radio_msg[0] + 1; // use the length already calculated and stored
         TRACE_OUTS("openThings_cmd(): sending...\n");
 
-        if ((ret = lock_ener314rt()) == 0)
+        if ((ret = radio_tx(RADIO_MODULATION_FSK, radio_msg, msglen, xmits)) == 0)
         {
-            radio_mod_transmit(RADIO_MODULATION_FSK, radio_msg, msglen, xmits);
-            unlock_ener314rt();
-
 #if defined(TRACE)
             printf("openThings_cmd(): sent\n");
 #endif
         }
         else
         {
-            TRACE_FAIL("openThings_cmd(): ERROR getting lock");
+            TRACE_FAIL("openThings_cmd(): ERROR radio unavailable");
         }
     }
 
@@ -944,9 +963,265 @@ int openThings_cache_cmd(unsigned char iProductId, unsigned int iDeviceId, unsig
         ret = -4;
     }
 
+    // let the receive loop see the new command straight away
+    if (ret == 0)
+        openThings_receive_wake();
+
     return ret;
 }
 
+/*
+** openThings_receive_wake()
+** =======
+** End any openThings_receive() that is waiting for a message, it returns with no message so that the caller can
+** re-check its state (e.g. monitoring being stopped) straight away instead of at the end of its timeout.
+*/
+void openThings_receive_wake(void)
+{
+    atomic_fetch_add(&g_RxWakeups, 1);
+    wake_radio_Rx();
+}
+
+// fixed message field names, see enum otMsgKey
+static const char *OTkeys[OTK_COUNT - OTK_DEVICEID] = {
+    "deviceId", "mfrId", "productId", "timestamp", "seq", "rxMonoUs", "rssi", "afc", "fei", "command", "retries",
+    "TARGET_TEMP", "VOLTAGE", "VOLTAGE_TS", "VALVE_STATE", "EXERCISE_VALVE", "VALVE_TS", "DIAGNOSTICS",
+    "DIAGNOSTICS_TS", "LOW_POWER_MODE", "ERRORS", "ERROR_TEXT"};
+
+// ',"name":' JSON fragment for every field key, built once by _key_frags_init()
+#define OT_KEY_FRAGLEN (OT_PARAM_NAME_LEN + 5)
+static struct
+{
+    char frag[OT_KEY_FRAGLEN];
+    unsigned char len;
+} OTkeyFrags[OTK_COUNT];
+static pthread_once_t OTkeyFragsOnce = PTHREAD_ONCE_INIT;
+
+/*
+** openThings_key_name() - copy the name of message field key into buf
+**
+** returns the length of the name, or -1 if key is not valid or buf is too small
+*/
+int openThings_key_name(int key, char *buf, unsigned int buflen)
+{
+    int len;
+
+    if (key >= OTK_DEVICEID && key < OTK_COUNT)
+        len = snprintf(buf, buflen, "%s", OTkeys[key - OTK_DEVICEID]);
+    else if (key >= OTK_COMMAND_BASE && key < OTK_DEVICEID)
+        len = snprintf(buf, buflen, "_%s", OTparams[key - OTK_COMMAND_BASE].paramName);
+    else if (key >= 0 && key < NUM_OT_PARAMS)
+        len = snprintf(buf, buflen, "%s", OTparams[key].paramName);
+    else
+        return -1;
+
+    return (len < 0 || (unsigned int)len >= buflen) ? -1 : len;
+}
+
+// store up to maxlen characters of str in the message text, returning its offset.  If text is full the message is
+// marked truncated and the offset of an empty string is returned
+static unsigned short _msg_text(struct OT_MSG *msg, const char *str, size_t maxlen)
+{
+    size_t len = strnlen(str, maxlen);
+    unsigned short off = msg->textLen;
+
+    if (off + len + 1 >= OT_MSG_TEXTLEN)
+    {
+        TRACE_FAIL("openThings_receive(): message text full\n");
+        msg->truncated = true;
+        msg->text[OT_MSG_TEXTLEN - 1] = '\0';
+        return OT_MSG_TEXTLEN - 1;
+    }
+    memcpy(msg->text + off, str, len);
+    msg->text[off + len] = '\0';
+    msg->textLen += len + 1;
+    return off;
+}
+
+// add a field to the message, name is only used for OTK_TEXT keys.  Returns NULL, marking the message truncated, if
+// the message is full
+static struct OT_FIELD *_msg_field(struct OT_MSG *msg, int key, const char *name, unsigned char type)
+{
+    struct OT_FIELD *field;
+
+    if (msg->count >= OT_MSG_MAX_FIELDS)
+    {
+        TRACE_FAIL("openThings_receive(): message full, field dropped\n");
+        msg->truncated = true;
+        return NULL;
+    }
+    field = &msg->fields[msg->count++];
+    field->key = key;
+    field->type = type;
+    field->name = (key == OTK_TEXT) ? _msg_text(msg, name, OT_PARAM_NAME_LEN) : 0;
+    return field;
+}
+
+static void _msg_int(struct OT_MSG *msg, int key, const char *name, int i)
+{
+    struct OT_FIELD *field = _msg_field(msg, key, name, OTF_INT);
+    if (field != NULL)
+        field->v.i = i;
+}
+
+static void _msg_u64(struct OT_MSG *msg, int key, unsigned long long u)
+{
+    struct OT_FIELD *field = _msg_field(msg, key, NULL, OTF_U64);
+    if (field != NULL)
+        field->v.u = u;
+}
+
+static void _msg_float(struct OT_MSG *msg, int key, const char *name, unsigned char type, float f)
+{
+    struct OT_FIELD *field = _msg_field(msg, key, name, type);
+    if (field != NULL)
+        field->v.f = f;
+}
+
+static void _msg_str(struct OT_MSG *msg, int key, const char *name, const char *str, size_t maxlen)
+{
+    struct OT_FIELD *field = _msg_field(msg, key, name, OTF_STR);
+    if (field != NULL)
+        field->v.str = _msg_text(msg, str, maxlen);
+}
+
+static void _msg_bool(struct OT_MSG *msg, int key, bool b)
+{
+    struct OT_FIELD *field = _msg_field(msg, key, NULL, OTF_BOOL);
+    if (field != NULL)
+        field->v.b = b;
+}
+
+/*
+** openThings_field_number() - numeric value of a field, as a js number
+**
+** Floats are rounded to the decimal places the JSON gives them so that both deliveries give the same numbers
+*/
+double openThings_field_number(const struct OT_FIELD *field)
+{
+    char num[32];
+
+    switch (field->type)
+    {
+    case OTF_INT:
+        return (double)field->v.i;
+    case OTF_U64:
+        return (double)field->v.u;
+    case OTF_FLOAT:
+        return nearbyint((double)field->v.f * 1e6) / 1e6;
+    case OTF_FLOAT1:
+        return nearbyint((double)field->v.f * 10) / 10;
+    case OTF_FLOAT2:
+        return nearbyint((double)field->v.f * 100) / 100;
+    case OTF_FLOATG:
+        // 6 significant digits, this is only used for assumed thermostat commands
+        snprintf(num, sizeof(num), "%g", field->v.f);
+        return strtod(num, NULL);
+    case OTF_BOOL:
+        return field->v.b ? 1 : 0;
+    }
+    return 0;
+}
+
+static void _key_frags_init(void)
+{
+    char name[OT_PARAM_NAME_LEN + 1];
+    int key, len;
+
+    for (key = 0; key < OTK_COUNT; key++)
+    {
+        if (openThings_key_name(key, name, sizeof(name)) < 0)
+            strcpy(name, "UNKNOWN");
+        len = snprintf(OTkeyFrags[key].frag, OT_KEY_FRAGLEN, ",\"%s\":", name);
+        OTkeyFrags[key].len = (len < OT_KEY_FRAGLEN) ? len : OT_KEY_FRAGLEN - 1;
+    }
+}
+
+/*
+** openThings_msg_json() - render a decoded message as JSON
+**
+** returns the length of the JSON, or OT_ERR_TRUNCATED if it did not fit into buf (buf then holds the truncated JSON)
+** or the message itself was truncated when it was decoded
+*/
+int openThings_msg_json(const struct OT_MSG *msg, char *buf, unsigned int buflen)
+{
+    const struct OT_FIELD *field;
+    struct JSON_WRITER jw;
+    unsigned int i, skip;
+    int len;
+
+    json_init(&jw, buf, buflen);
+
+    if (msg->count == 0)
+    {
+        // no message available
+        JSON_LIT(&jw, "{\"deviceId\": 0}");
+    }
+    else
+    {
+        pthread_once(&OTkeyFragsOnce, _key_frags_init);
+
+        json_char(&jw, '{');
+        for (i = 0; i < msg->count; i++)
+        {
+            field = &msg->fields[i];
+
+            // key, the first has no leading ','
+            if (field->key >= 0 && field->key < OTK_COUNT)
+            {
+                skip = (i == 0) ? 1 : 0;
+                json_raw(&jw, OTkeyFrags[field->key].frag + skip, OTkeyFrags[field->key].len - skip);
+            }
+            else
+            {
+                if (i > 0)
+                    json_char(&jw, ',');
+                json_str(&jw, msg->text + field->name);
+                json_char(&jw, ':');
+            }
+
+            switch (field->type)
+            {
+            case OTF_INT:
+                json_int(&jw, field->v.i);
+                break;
+            case OTF_U64:
+                json_uint(&jw, field->v.u);
+                break;
+            case OTF_FLOAT:
+                json_fixed(&jw, field->v.f, 6);
+                break;
+            case OTF_FLOAT1:
+                json_fixed(&jw, field->v.f, 1);
+                break;
+            case OTF_FLOAT2:
+                json_fixed(&jw, field->v.f, 2);
+                break;
+            case OTF_FLOATG:
+                json_general(&jw, field->v.f);
+                break;
+            case OTF_STR:
+                json_str(&jw, msg->text + field->v.str);
+                break;
+            case OTF_BOOL:
+                json_bool(&jw, field->v.b);
+                break;
+            default:
+                JSON_LIT(&jw, "0");
+            }
+        }
+        json_char(&jw, '}');
+    }
+
+    if ((len = json_end(&jw)) < 0 || msg->truncated)
+    {
+        TRACE_FAIL("openThings_msg_json(): message truncated\n");
+        return OT_ERR_TRUNCATED;
+    }
+
+    return len;
+}
+
 /*
 ** openThings_receive()
 ** =======
@@ -968,11 +1243,31 @@ int openThings_cache_cmd(unsigned char iProductId, unsigned int iDeviceId, unsig
 **   - formatting and decoding the OpenThings FSK radio responses
 **   - auto add any devices to device list, responding to join requests if applicable
 **   - If a cached command is outstanding for a device that only has a small receive window (e.g. eTRV), send the command
-**   - returning JSON for the received msg OR returning '{"deviceId": 0}' if no msg available
+**   - returning the decoded msg, as fields in msg, OR an empty msg (deviceId 0) if no msg available
 **
-** TODO (optimisations):
+** openThings_receive() returns the message as JSON, or '{"deviceId": 0}' if no msg is available.  If the JSON does
+** not fit into buflen it returns OT_ERR_TRUNCATED (OT_MSG_JSONLEN is always enough)
 */
 int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
+{
+    struct OT_MSG msg;
+    int records;
+
+    records = openThings_receive_msg(&msg, timeout);
+    if (openThings_msg_json(&msg, OTmsg, buflen) < 0 && msg.count > 0)
+        return OT_ERR_TRUNCATED;
+
+    if (msg.count > 0)
+    {
+        TRACE_OUTS("openThings_receive(): Returning: ");
+        TRACE_OUTS(OTmsg);
+        TRACE_NL();
+    }
+
+    return records;
+}
+
+int openThings_receive_msg(struct OT_MSG *msg, unsigned int timeout)
 {
     // int ret = 0;
     // uint8_t buf[MAX_FIFO_BUFFER];
@@ -980,20 +1275,23 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
     unsigned char mfrId, productId;
     unsigned int iDeviceId;
     int records, i, msgsInRxBuf;
+#if defined(FULLTRACE)
     char OTrecord[200];
+#endif
     struct RADIO_MSG rxMsg;
     bool joined = false;
     ;
     int OTdi;
-    struct timeval startTime, currentTime, diffTime;
+    struct timespec startTime, currentTime;
     unsigned int diff = 0;
+    unsigned int wakeups = atomic_load(&g_RxWakeups);
+    unsigned int rxGen;
 
-    // printf("openthings_receive(): called, buflen=%d\n", buflen);
 
     // record startTime for timeout
     if (timeout > 0)
     {
-        gettimeofday(&startTime, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
     }
     else
     {
@@ -1001,33 +1299,36 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
     }
 
     // set default message if no message available
-    strcpy(OTmsg, "{\"deviceId\": 0}");
+    msg->deviceId = 0;
+    msg->count = 0;
+    msg->textLen = 0;
+    msg->truncated = false;
+
+    /*
+    ** Stage 1 - emptying the Rx buffer on the radio device is done by the radio owner thread, which stores the
+    ** messages in the Rx ring independently of us.  This request puts it into monitor mode and collects anything
+    ** already waiting.
+    */
+    if (empty_radio_Rx_buffer(DT_MONITOR) < 0)
+    {
+        // probably been asked to close quit loop
+        return -3;
+    }
 
     // 2 nested loops here, the plan is to wait until we have a valid message or the 'timeout' is reached:
-    //  - the 1st loop empties the radio buffer
-    //  - the end loops until buffer empty or we have a valid OT msg
+    //  - the 1st loop waits for the owner thread to store messages in the Rx ring
+    //  - the end loops until the ring is empty or we have a valid OT msg
     do
     {
         // Clear data
         records = -1;
         iDeviceId = 0;
 
-        /*
-        ** Stage 1 - empty the Rx buffer on the radio device (with locking)
-        */
-        if ((i = lock_ener314rt()) == 0)
-        {
-            i = empty_radio_Rx_buffer(DT_MONITOR);
-            unlock_ener314rt();
-        }
-        else
-        {
-            // probably been asked to close quit loop
-            return -3;
-        }
+        // anything stored in the ring (or any wake-up) after this ends the wait below straight away
+        rxGen = radio_rx_gen();
 
         /*
-        ** Stage 2 - decode and process next message in RxMsgs buffer
+        ** Stage 2 - decode and process next message in the Rx ring
         */
         // printf("<%d-%d>",pRxMsgHead, pRxMsgTail);
 
@@ -1043,11 +1344,21 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
                 // printf("openThings_decode() returned %d records for deviceId=%d\n",records, iDeviceId);
                 if (records > 0)
                 {
-                    // build response JSON
-                    sprintf(OTmsg, "{\"deviceId\":%d,\"mfrId\":%d,\"productId\":%d,\"timestamp\":%d", iDeviceId, mfrId, productId, (int)rxMsg.t);
+                    // build response
+                    // rxMonoUs is given in microseconds so that it is exactly representable as a js number
+                    msg->deviceId = iDeviceId;
+                    _msg_int(msg, OTK_DEVICEID, NULL, (int)iDeviceId);
+                    _msg_int(msg, OTK_MFRID, NULL, mfrId);
+                    _msg_int(msg, OTK_PRODUCTID, NULL, productId);
+                    _msg_int(msg, OTK_TIMESTAMP, NULL, (int)rxMsg.t);
+                    _msg_u64(msg, OTK_SEQ, rxMsg.seq);
+                    _msg_u64(msg, OTK_RXMONOUS, rxMsg.monoNs / 1000);
+                    _msg_float(msg, OTK_RSSI, NULL, OTF_FLOAT1, rxMsg.rssi);
+                    _msg_int(msg, OTK_AFC, NULL, (int)rxMsg.afc);
+                    _msg_int(msg, OTK_FEI, NULL, (int)rxMsg.fei);
 #if defined(FULLTRACE)
-                    TRACE_OUTS("openThings_receive(): hdr: ");
-                    TRACE_OUTS(OTmsg);
+                    TRACE_OUTS("openThings_receive(): hdr: deviceId=");
+                    TRACE_OUTN(iDeviceId);
                     TRACE_NL();
 #endif
                     // add records
@@ -1062,11 +1373,9 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
                         switch (OTrecs[i].typeIndex)
                         {
                         case OTR_CHAR: // CHAR
-                            sprintf(OTrecord, ",\"%s\":\"%s\"", OTrecs[i].paramName, OTrecs[i].retChar);
+                            _msg_str(msg, OTrecs[i].key, OTrecs[i].paramName, OTrecs[i].retChar, sizeof(OTrecs[i].retChar));
                             break;
                         case OTR_INT:
-                            sprintf(OTrecord, ",\"%s\":%d", OTrecs[i].paramName, OTrecs[i].retInt);
-
                             // Special record processing
                             switch (OTrecs[i].paramId)
                             {
@@ -1078,18 +1387,21 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
                                 TRACE_NL();
                                 openThings_joinACK(productId, iDeviceId, 20);
                                 joined = true;
+                                _msg_int(msg, OTrecs[i].key, OTrecs[i].paramName, OTrecs[i].retInt);
                                 break;
                             case OTP_TEMPERATURE: // TEMPERATURE
                                 // Seems that TEMPERATURE (OTP_TEMPERATURE) received as type OTR_INT=1, and it should be OTR_FLOAT=2 from the eTRV, so override and return a float instead
-                                sprintf(OTrecord, ",\"%s\":%.1f", OTrecs[i].paramName, OTrecs[i].retFloat);
+                                _msg_float(msg, OTrecs[i].key, OTrecs[i].paramName, OTF_FLOAT1, OTrecs[i].retFloat);
                                 break;
+                            default:
+                                _msg_int(msg, OTrecs[i].key, OTrecs[i].paramName, OTrecs[i].retInt);
                             }
                             break;
                         case OTR_FLOAT:
-                            sprintf(OTrecord, ",\"%s\":%f", OTrecs[i].paramName, OTrecs[i].retFloat);
+                            _msg_float(msg, OTrecs[i].key, OTrecs[i].paramName, OTF_FLOAT, OTrecs[i].retFloat);
                             break;
                         case 0:  // No data
-                            sprintf(OTrecord, ",\"%s\":0", OTrecs[i].paramName);
+                            _msg_int(msg, OTrecs[i].key, OTrecs[i].paramName, 0);
                             if (OTrecs[i].paramId == OTCP_JOIN){
                                 // We seem to have stumbled upon an instruction to join outside of discovery loop, may as well autojoin the device
                                 TRACE_OUTS("openThings_receive(): New device found, sending ACK: deviceId:");
@@ -1105,15 +1417,13 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
 #if defined(TRACE)
                             printf("openThings_receive(): WARNING type:%d unknown assuming INT. str:%s,int:%d,float:%f\n", OTrecs[i].typeIndex, OTrecs[i].retChar, OTrecs[i].retInt, OTrecs[i].retFloat);
 #endif
-                            sprintf(OTrecord, ",\"%s\":%d", OTrecs[i].paramName, OTrecs[i].retInt);
+                            _msg_int(msg, OTrecs[i].key, OTrecs[i].paramName, OTrecs[i].retInt);
                         }
-
-                        // add OT record to returned msg
-                        strcat(OTmsg, OTrecord);
                     }
 
                     // Add to deviceList
                     OTdi = openThings_devicePut(iDeviceId, mfrId, productId, joined);
+                    _update_signal(OTdi, &rxMsg);
 
                     // Perform any device specific processing
                     switch (productId)
@@ -1122,7 +1432,7 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
                         // Update eTRV data and append stored info, only one record is ever returned
                         eTRV_update(OTdi, OTrecs[0], rxMsg.t);
                         // Add static params to returned message, this can result in DIAGNOSTICS flag being sent twice, but node copes with that OK
-                        eTRV_get_status(OTdi, OTmsg, buflen);
+                        eTRV_get_status(OTdi, msg);
                         break;
 
                     case PRODUCTID_MIHO069: // thermostat
@@ -1169,8 +1479,7 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
 #ifdef TRACE
                                                 printf("openThings_receive(): rec:+ command %s (%d) assumed processed\n",OTparams[i].paramName,g_OTdevices[OTdi].cache->command);
 #endif
-                                                sprintf(OTrecord, ",\"%s\":%g",OTparams[i].paramName, g_OTdevices[OTdi].cache->data);
-                                                strcat(OTmsg, OTrecord);
+                                                _msg_float(msg, i, NULL, OTF_FLOATG, g_OTdevices[OTdi].cache->data);
                                             }
                                     }
 
@@ -1210,19 +1519,12 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
                             }
 
                             // return cached command status (even if retries is 0)
-                            sprintf(OTrecord, ",\"command\":%d,\"retries\":%d",
-                                    g_OTdevices[OTdi].cache->command,
-                                    g_OTdevices[OTdi].cache->retries);
-                            strcat(OTmsg, OTrecord);
+                            _msg_int(msg, OTK_COMMAND, NULL, g_OTdevices[OTdi].cache->command);
+                            _msg_int(msg, OTK_RETRIES, NULL, g_OTdevices[OTdi].cache->retries);
                         }
                     }
 
-                    // close record array
-                    strcat(OTmsg, "}");
-
-                    TRACE_OUTS("openThings_receive(): Returning: ");
-                    TRACE_OUTS(OTmsg);
-                    TRACE_NL();
+                    rx_decoded(&rxMsg);
 
                     // we have a message, return
                     return records;
@@ -1245,23 +1547,26 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
         if (timeout > 0)
         {
             // Rx buffer is empty, sleep a bit before emptying again
-            gettimeofday(&currentTime, NULL);
-            timersub(&currentTime, &startTime, &diffTime);
-            diff = (diffTime.tv_sec * 1000) + diffTime.tv_usec;
+            clock_gettime(CLOCK_MONOTONIC, &currentTime);
+            diff = (unsigned int)((currentTime.tv_sec - startTime.tv_sec) * 1000 + (currentTime.tv_nsec - startTime.tv_nsec) / 1000000);
 
-            // sleep a very small bit if we are in WaitForMsg mode for eTRVs only, these have an Rx window of 200ms
-            if (diff < timeout)
+            // wait for the owner thread to store a message, never beyond the timeout; it drains the radio as soon
+            // as a message arrives so there is no need to poll quickly for the eTRV 200ms Rx window here.  Waiting
+            // is ended early by openThings_receive_wake()
+            if (diff < timeout && atomic_load(&g_RxWakeups) == wakeups)
             {
-                if (g_CachedCmds > 0)
-                {
-                    usleep(25000); // 25ms
-                }
-                else
+                if (wait_radio_Rx(timeout - diff, rxGen) < 0)
                 {
-                    // sleep reduced to 0.5s from 5s (issue #14 - events missed)
-                    usleep(500000);
+                    // radio closed
+                    return -3;
                 }
             }
+
+            if (atomic_load(&g_RxWakeups) != wakeups)
+            {
+                TRACE_OUTS("openThings_receive(): woken\n");
+                return records;
+            }
         }
     } while (timeout > diff);
 
@@ -1276,12 +1581,14 @@ int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout)
 **  - learn a new device
 **  - or by a manual poll if empty
 **
-** v0.4.1: Changed return type to a dynamically allocated string, which should be free()d by caller
+** v0.4.1: Changed return type to a string
+** Returns a static buffer (sized for MAX_DEVICES) instead of allocating for each call; do not free() it, it is only
+** valid until the next call.  Returns NULL if the list did not fit into it.
 */
 char *openThings_deviceList(bool scan)
 {
     int i;
-    char deviceStr[100];
+    struct JSON_WRITER jw;
 
     TRACE_OUTS("openthings_deviceList(): called\n");
 
@@ -1291,27 +1598,58 @@ char *openThings_deviceList(bool scan)
         openthings_scan(11);
     }
 
-    // allocate the memory for the deviceList, 100 chars per device + headers
-    char *devices = malloc(50 + (g_NumDevices * 100));
+    // 250 chars per device + headers
+    static char devices[OT_DEVICELIST_BUFLEN];
 
     // begin message
-    sprintf(devices, "{\"numDevices\":%d, \"devices\":[\n", g_NumDevices);
+    json_init(&jw, devices, sizeof(devices));
+    JSON_LIT(&jw, "{\"numDevices\":");
+    json_int(&jw, g_NumDevices);
+    JSON_LIT(&jw, ", \"devices\":[\n");
 
     for (i = 0; i < g_NumDevices; i++)
     {
         // add device to JSON
-        sprintf(deviceStr, "{\"mfrId\":%d,\"productId\":%d,\"deviceId\":%d,\"control\":%d,\"product\":\"%s\",\"joined\":%d}",
-                g_OTdevices[i].mfrId, g_OTdevices[i].productId, g_OTdevices[i].deviceId, g_OTdevices[i].control, g_OTdevices[i].product, g_OTdevices[i].joined);
-        strcat(devices, deviceStr);
+        JSON_LIT(&jw, "{\"mfrId\":");
+        json_int(&jw, g_OTdevices[i].mfrId);
+        JSON_LIT(&jw, ",\"productId\":");
+        json_int(&jw, g_OTdevices[i].productId);
+        JSON_LIT(&jw, ",\"deviceId\":");
+        json_int(&jw, g_OTdevices[i].deviceId);
+        JSON_LIT(&jw, ",\"control\":");
+        json_int(&jw, g_OTdevices[i].control);
+        JSON_LIT(&jw, ",\"product\":");
+        json_str(&jw, g_OTdevices[i].product);
+        JSON_LIT(&jw, ",\"joined\":");
+        json_int(&jw, g_OTdevices[i].joined);
+        JSON_LIT(&jw, ",\"rxCount\":");
+        json_uint(&jw, g_OTdevices[i].signal.count);
+        JSON_LIT(&jw, ",\"rssi\":");
+        json_fixed(&jw, g_OTdevices[i].signal.rssi, 1);
+        JSON_LIT(&jw, ",\"rssiAvg\":");
+        json_fixed(&jw, g_OTdevices[i].signal.rssiAvg, 1);
+        JSON_LIT(&jw, ",\"rssiMin\":");
+        json_fixed(&jw, g_OTdevices[i].signal.rssiMin, 1);
+        JSON_LIT(&jw, ",\"rssiMax\":");
+        json_fixed(&jw, g_OTdevices[i].signal.rssiMax, 1);
+        JSON_LIT(&jw, ",\"feiAvg\":");
+        json_int(&jw, (int)g_OTdevices[i].signal.feiAvg);
+        json_char(&jw, '}');
         if (i + 1 < g_NumDevices)
         {
             // more records to come add a ',' to JSON array
-            strcat(devices, ",\n");
+            JSON_LIT(&jw, ",\n");
         }
     }
 
     // close message
-    strcat(devices, "]}");
+    JSON_LIT(&jw, "]}");
+
+    if (json_end(&jw) < 0)
+    {
+        TRACE_FAIL("openthings_deviceList(): device list truncated\n");
+        return NULL;
+    }
 
 #if defined(TRACE)
     TRACE_OUTS("openthings_deviceList(): Returning: ");
@@ -1335,7 +1673,7 @@ void openthings_scan(int iTimeOut)
     struct OTrecord OTrecs[OT_MAX_RECS];
     unsigned char mfrId, productId;
     unsigned int iDeviceId;
-    int records, i, j;
+    int records, recs, i, j;
     // char OTrecord[100];
     struct RADIO_MSG rxMsg;
     bool joined = false;
@@ -1353,11 +1691,10 @@ void openthings_scan(int iTimeOut)
     // do a few calls to switch to initiate monitor mode and populate the RxBuffer
     for (i = 0; i < iTimeOut; i++)
     {
-        if ((lock_ener314rt()) == 0)
+        if ((recs = empty_radio_Rx_buffer(DT_LEARN)) >= 0)
         {
-            records += empty_radio_Rx_buffer(DT_LEARN);
-            unlock_ener314rt();
-            if (records >= RX_MSGS)
+            records += recs;
+            if (records >= (int)rx_ring_size())
                 break;
         }
         // wait for more messages
@@ -1366,9 +1703,9 @@ void openthings_scan(int iTimeOut)
     }
 
     /*
-    ** Stage 2 - peek ALL the messages in RxMsgs buffer; this is non-destructive
+    ** Stage 2 - peek ALL the unread messages in the receive ring; this is non-destructive
     */
-    for (i = 0; i < RX_MSGS; i++)
+    for (i = 0; i < (int)rx_ring_size(); i++)
     {
         if (get_RxMsg(i, &rxMsg) > 0)
         {
@@ -1462,22 +1799,14 @@ int openThings_joinACK(unsigned char iProductId, unsigned int iDeviceId, unsigne
     // Stage 1d: encrypt body part of message (default PIP is OK here)
     cryptMsg(CRYPT_PID, CRYPT_PIP, &radio_msg[5], (OTA_MSGLEN - 5));
 
-    // mutex access radio adaptor
-    if ((ret = lock_ener314rt()) != 0)
+    /*
+    ** Stage 3: Transmit via radio adaptor owner thread
+    */
+    // Transmit encoded payload 26ms per payload * xmits
+    if ((ret = radio_tx(RADIO_MODULATION_FSK, radio_msg, OTA_MSGLEN, xmits)) != 0)
     {
         return -1;
     }
-    else
-    {
-        /*
-        ** Stage 3: Transmit via radio adaptor, using mutex to block the radio
-        */
-        // Transmit encoded payload 26ms per payload * xmits
-        radio_mod_transmit(RADIO_MODULATION_FSK, radio_msg, OTA_MSGLEN, xmits);
-
-        // release mutex lock
-        unlock_ener314rt();
-    }
 
     return ret;
 }
@@ -1507,14 +1836,13 @@ void openThings_cache_send(unsigned char index)
         if (msglen > 1)
         {
             // we have a cached command, send it
-            if ((lock_ener314rt()) == 0)
+            if (radio_tx(RADIO_MODULATION_FSK, g_OTdevices[index].cache->radio_msg, msglen, 1) == 0) // TODO make xmits configurable
             {
-                radio_mod_transmit(RADIO_MODULATION_FSK, g_OTdevices[index].cache->radio_msg, msglen, 1); // TODO make xmits configurable
 #ifdef TRACE
             printf("openThings_cache_send(): sent cached cmd %d:%g for device %d\n",g_OTdevices[index].cache->command,g_OTdevices[index].cache->data,g_OTdevices[index].deviceId);
 #endif
 
-                // Check if PreCached and swap over globals (within lock)
+                // Check if PreCached and swap over globals
                 if (g_PreCachedCmds > 0 && !g_OTdevices[index].cache->active)
                 {
                     // TODO: added mutex
@@ -1523,7 +1851,6 @@ void openThings_cache_send(unsigned char index)
                     _update_cachedcmd_count(1, true);
                     TRACE_OUTS("openThings_cache_send(): swapped g_counts\n");
                 }
-                unlock_ener314rt();
                 g_OTdevices[index].cache->retries--;
 
                 // If we have reached 0 retries, decrement cachedCmd count and reset the command too
@@ -1697,61 +2024,50 @@ void eTRV_update(int OTdi, struct OTrecord OTrec, time_t updateTime)
 /*
 ** eTRV_get_status()
 ** ===================
-** JSONify stored data for the eTRV record structure for reporting
-** data is appended to incoming buf as key value comma separated pairs
+** Add stored data for the eTRV record structure to a received message for reporting
 **
 **  OTdi - Index in g_OTdevices array (for speed)
-**  buf  - buf appended with new data
-**  buflen - length of buffer to prevent memory errors
+**  msg  - message the data is added to as fields
 */
-void eTRV_get_status(int OTdi, char *buf, unsigned int buflen)
+void eTRV_get_status(int OTdi, struct OT_MSG *msg)
 {
     struct TRV_DEVICE *trvData;
     trvData = g_OTdevices[OTdi].trv; // make a pointer to correct struct in array for speed
-    char trvStatus[200] = "";
     static const char *VALVE_STR[] = {"open", "closed", "auto", "error", "unknown"};
 
     // populate cached command (even if retries is 0)
     if (g_OTdevices[OTdi].cache != NULL)
     {
-        sprintf(trvStatus, ",\"command\":%d,\"retries\":%d",
-                g_OTdevices[OTdi].cache->command,
-                g_OTdevices[OTdi].cache->retries);
-        strncat(buf, trvStatus, buflen);
+        _msg_int(msg, OTK_COMMAND, NULL, g_OTdevices[OTdi].cache->command);
+        _msg_int(msg, OTK_RETRIES, NULL, g_OTdevices[OTdi].cache->retries);
     }
     if (g_OTdevices[OTdi].trv != NULL)
     {
         if (trvData->targetC > 0)
         {
-            sprintf(trvStatus, ",\"TARGET_TEMP\":%.1f", trvData->targetC);
-            strncat(buf, trvStatus, buflen);
+            _msg_float(msg, OTK_TARGET_TEMP, NULL, OTF_FLOAT1, trvData->targetC);
         }
         if (trvData->voltage > 0)
         {
-            sprintf(trvStatus, ",\"VOLTAGE\":%.2f,\"VOLTAGE_TS\":%d", trvData->voltage, (int)trvData->voltageDate);
-            strncat(buf, trvStatus, buflen);
+            _msg_float(msg, OTK_VOLTAGE, NULL, OTF_FLOAT2, trvData->voltage);
+            _msg_int(msg, OTK_VOLTAGE_TS, NULL, (int)trvData->voltageDate);
         }
         if (trvData->valve != UNKNOWN)
         {
-            sprintf(trvStatus, ",\"VALVE_STATE\":\"%s\"", VALVE_STR[trvData->valve]);
-            strncat(buf, trvStatus, buflen);
+            _msg_str(msg, OTK_VALVE_STATE, NULL, VALVE_STR[trvData->valve], MAX_ERRSTR);
         }
         if (trvData->valveDate > 0)
         {
-            sprintf(trvStatus, ",\"EXERCISE_VALVE\":\"%s\",\"VALVE_TS\":%d",
-                    trvData->exerciseValve ? "success" : "fail",
-                    (int)trvData->valveDate);
-            strncat(buf, trvStatus, buflen);
+            _msg_str(msg, OTK_EXERCISE_VALVE, NULL, trvData->exerciseValve ? "success" : "fail", MAX_ERRSTR);
+            _msg_int(msg, OTK_VALVE_TS, NULL, (int)trvData->valveDate);
         }
         if (trvData->diagnosticDate > 0)
         {
-            sprintf(trvStatus, ",\"DIAGNOSTICS\":%d,\"DIAGNOSTICS_TS\":%d,\"LOW_POWER_MODE\":%s,\"ERRORS\":%s,\"ERROR_TEXT\":\"%s\"",
-                    trvData->diagnostics,
-                    (int)trvData->diagnosticDate,
-                    trvData->lowPowerMode ? "true" : "false",
-                    trvData->errors ? "true" : "false",
-                    trvData->errString);
-            strncat(buf, trvStatus, buflen);
+            _msg_int(msg, OTK_DIAGNOSTICS, NULL, (int)trvData->diagnostics);
+            _msg_int(msg, OTK_DIAGNOSTICS_TS, NULL, (int)trvData->diagnosticDate);
+            _msg_bool(msg, OTK_LOW_POWER_MODE, trvData->lowPowerMode);
+            _msg_bool(msg, OTK_ERRORS, trvData->errors);
+            _msg_str(msg, OTK_ERROR_TEXT, NULL, trvData->errString, sizeof(trvData->errString));
         }
     }
     else
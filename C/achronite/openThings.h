@@ -7,6 +7,8 @@
 #define OTSEND_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #define FSK_MODE 1
 #define ENERGENIE_MFRID 0x04
@@ -177,6 +179,7 @@ struct OTrecord {
     char paramName[OT_PARAM_NAME_LEN];
     unsigned char typeId;
     char  typeIndex;
+    short key;                   // message field key (OTK_TEXT if the parameter is unknown)
     int   retInt;                // I'm hoping this deals with signed and unsigned values
     float retFloat;
     char  retChar[15];            // Length max is 15 for a record
@@ -186,6 +189,49 @@ struct OTrecord {
 #define OTR_FLOAT 2
 #define OTR_CHAR 3
 
+// Decoded message, filled by openThings_receive_msg().  Each field is a key and a typed value, which is either
+// rendered as JSON (openThings_msg_json) or turned into js properties directly by the addon.
+//
+// Field keys 0..NUM_OT_PARAMS-1 are the OTparams names, NUM_OT_PARAMS..2*NUM_OT_PARAMS-1 the command ('_' prefixed)
+// names, followed by the fixed names below; see openThings_key_name().  OTK_TEXT fields hold their name in text.
+enum otMsgKey {OTK_TEXT = -1,
+               OTK_COMMAND_BASE = NUM_OT_PARAMS,
+               OTK_DEVICEID = 2 * NUM_OT_PARAMS, OTK_MFRID, OTK_PRODUCTID, OTK_TIMESTAMP, OTK_SEQ, OTK_RXMONOUS,
+               OTK_RSSI, OTK_AFC, OTK_FEI, OTK_COMMAND, OTK_RETRIES, OTK_TARGET_TEMP, OTK_VOLTAGE, OTK_VOLTAGE_TS,
+               OTK_VALVE_STATE, OTK_EXERCISE_VALVE, OTK_VALVE_TS, OTK_DIAGNOSTICS, OTK_DIAGNOSTICS_TS,
+               OTK_LOW_POWER_MODE, OTK_ERRORS, OTK_ERROR_TEXT,
+               OTK_COUNT};
+
+// Field types, the float types differ only in how many decimal places the legacy JSON gives them
+enum otFieldType {OTF_INT = 1, OTF_U64, OTF_FLOAT, OTF_FLOAT1, OTF_FLOAT2, OTF_FLOATG, OTF_STR, OTF_BOOL};
+
+#define OT_MSG_MAX_FIELDS 40
+#define OT_MSG_TEXTLEN (OT_MAX_RECS * (OT_PARAM_NAME_LEN + 16) + 128)  // every record unknown with a string value, + eTRV status
+#define OT_MSG_JSONLEN 1280             // room for the JSON of the largest message (OT_MAX_RECS records)
+#define OT_ERR_TRUNCATED -6             // the JSON did not fit into the buffer given
+
+struct OT_FIELD {
+    short key;                          // enum otMsgKey, or an index into the OTparams names
+    unsigned char type;                 // enum otFieldType
+    unsigned short name;                // OTK_TEXT only: offset of the name in text
+    union {
+        int i;
+        unsigned long long u;
+        float f;
+        bool b;
+        unsigned short str;             // OTF_STR: offset of the value in text
+    } v;
+};
+
+struct OT_MSG {
+    unsigned int deviceId;              // 0 if there is no message
+    unsigned char count;                // fields used
+    unsigned short textLen;             // text used
+    bool truncated;                     // fields or text did not fit, the message is incomplete
+    struct OT_FIELD fields[OT_MSG_MAX_FIELDS];
+    char text[OT_MSG_TEXTLEN];
+};
+
 // eTRV specific stuff
 enum valveState {OPEN = 0, CLOSED = 1, TEMPC = 2, ERROR = 3, UNKNOWN = 4};
 #define MAX_ERRSTR 50
@@ -227,6 +273,19 @@ struct STAT_DEVICE {
 #define THERMOSTAT_TX_RETRIES 2
 #define THERMOSTAT_AUTO_TELEMETRY_TIME 300  // every 5 minutes
 
+// Rolling signal quality for a device, updated for every message received from it
+#define OT_SIGNAL_EWMA_SHIFT 3          // averages weight each new message by 1/8
+struct OT_SIGNAL {
+    uint32_t      count;
+    float         rssi;                 // last
+    float         rssiAvg;
+    float         rssiMin;
+    float         rssiMax;
+    int32_t       afc;                  // last
+    int32_t       fei;                  // last
+    int32_t       feiAvg;
+};
+
 // DeviceList structure
 struct OT_DEVICE {
     unsigned int  deviceId;
@@ -238,9 +297,11 @@ struct OT_DEVICE {
     struct CACHED_CMD *cache;                   // need to malloc if used
     struct TRV_DEVICE *trv;                     // need to malloc if used
     struct STAT_DEVICE *thermostat;             // need to malloc if used
+    struct OT_SIGNAL signal;
 };
 
 #define MAX_DEVICES 30
+#define OT_DEVICELIST_BUFLEN (50 + (MAX_DEVICES * 250))
 
 
 struct OT_PRODUCT {
@@ -257,6 +318,11 @@ int openThings_switch(unsigned char iProductId, unsigned int iDeviceId, unsigned
 int openThings_cmd(unsigned char iProductId, unsigned int iDeviceId, unsigned char command, float fData, unsigned char xmits);
 char * openThings_deviceList(bool scan);
 int openThings_receive(char *OTmsg, unsigned int buflen, unsigned int timeout);
+int openThings_receive_msg(struct OT_MSG *msg, unsigned int timeout);
+int openThings_msg_json(const struct OT_MSG *msg, char *buf, unsigned int buflen);
+int openThings_key_name(int key, char *buf, unsigned int buflen);
+double openThings_field_number(const struct OT_FIELD *field);
+void openThings_receive_wake(void);
 int openThings_joinACK(unsigned char iProductId, unsigned int iDeviceId, unsigned char xmits);
 void openthings_scan(int iTimeOut);
 
@@ -264,7 +330,7 @@ int openThings_cache_cmd(unsigned char iProductId, unsigned int iDeviceId, unsig
 void openThings_cache_send(unsigned char index);
 //int openThings_build_msg(unsigned char iProductId, unsigned int iDeviceId, unsigned char iCommand, unsigned int iData, unsigned char *radio_msg);
 void eTRV_update(int OTdi, struct OTrecord OTrec, time_t updateTime);
-void eTRV_get_status(int OTdi, char *buf, unsigned int buflen);
+void eTRV_get_status(int OTdi, struct OT_MSG *msg);
 
 #endif
 
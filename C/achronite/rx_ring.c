@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "rx_ring.h"
+#include "../energenie/trace.h"
+
+/*
+** C module addition to energenie code providing the receive buffer used between emptying the radio FIFO and
+** decoding the OpenThings messages.
+**
+** This is a single-producer / multi-consumer ring.  The producer is the radio owner thread, which empties the
+** radio.  The consumers are every OpenThings receive loop: the monitor thread, the async receive thread and a
+** synchronous openThingsReceive can all pop at once, and openthings_scan peeks.  head and tail are free running
+** counters, the slot is found by masking with (size - 1), which is why the size is always a power of 2.
+**
+** When the ring is full the producer either discards the new message (RX_DROP_NEWEST) or takes the oldest slot
+** from the consumers (RX_DROP_OLDEST).  A consumer only claims a message once it has copied it, by moving the tail
+** with a compare-and-swap.  If the tail has moved since it was read, because the producer dropped the slot or
+** another consumer claimed it first, the CAS fails, the copy is discarded and the consumer tries again with the
+** next message.  This is what makes several consumers safe: each message is claimed by exactly one of them, so the
+** CAS must not be replaced by a plain store even if there only appears to be one consumer.  rx_ring_peek() does not
+** claim, so its copy can be of a message that is being popped or overwritten at the same time.
+**
+** The ring is only (re)allocated by init_ener314rt() before the producer starts, but consumers can still be polling
+** it then.  They count themselves in and out of 'readers' around every access, and the old ring is unpublished and
+** only freed once no consumer is left inside, so memory is never freed beneath a consumer.
+**
+** Author: Phil Grainger - @Achronite
+*/
+
+static struct RADIO_MSG *_Atomic slots = NULL;
+static atomic_uint readers = 0;     // consumers currently using slots
+static uint32_t mask = 0;
+static enum rxDropPolicy dropPolicy = RX_DROP_OLDEST;
+
+static atomic_uint head = 0;        // next slot to write, only moved by producer
+static atomic_uint tail = 0;        // next slot to read, moved by consumer (and producer when dropping oldest)
+
+// counters (written by producer only)
+static atomic_uint enqueued = 0;
+static atomic_uint dropped = 0;
+static atomic_uint highWater = 0;
+
+/*
+** rx_ring_init() - allocate the ring, size is rounded up to the next power of 2
+**
+** Must not be called whilst the producer is active, consumers are waited for
+*/
+int rx_ring_init(unsigned int size, enum rxDropPolicy policy)
+{
+    unsigned int n = 1;
+    struct RADIO_MSG *ring;
+
+    if (size == 0 || size > RX_RING_MAX_SIZE)
+        size = RX_RING_DEFAULT_SIZE;
+
+    while (n < size)
+        n <<= 1;
+
+    rx_ring_free();
+
+    ring = ener_calloc(n, sizeof(struct RADIO_MSG));
+    if (ring == NULL)
+    {
+        TRACE_FAIL("rx_ring_init(): unable to allocate ring\n");
+        return -1;
+    }
+
+    mask = n - 1;
+    dropPolicy = policy;
+    atomic_store(&head, 0);
+    atomic_store(&tail, 0);
+    atomic_store(&enqueued, 0);
+    atomic_store(&dropped, 0);
+    atomic_store(&highWater, 0);
+
+    // publish the ring once it is set up
+    atomic_store(&slots, ring);
+
+    TRACE_OUTS("rx_ring_init(): size=");
+    TRACE_OUTN(n);
+    TRACE_NL();
+
+    return 0;
+}
+
+/*
+** rx_ring_free() - unpublish the ring and free it once no consumer is using it
+**
+** Must not be called whilst the producer is active
+*/
+void rx_ring_free(void)
+{
+    struct RADIO_MSG *ring = atomic_exchange(&slots, NULL);
+
+    // consumers that saw the old ring finish with it before it is freed, later ones see NULL
+    while (atomic_load(&readers) > 0)
+        sched_yield();
+
+    free(ring);
+    mask = 0;
+}
+
+// count a consumer in, returns the ring or NULL if there is none (in which case the consumer is already counted out)
+static struct RADIO_MSG *_reader_enter(void)
+{
+    struct RADIO_MSG *ring;
+
+    atomic_fetch_add(&readers, 1);
+    ring = atomic_load(&slots);
+    if (ring == NULL)
+        atomic_fetch_sub(&readers, 1);
+    return ring;
+}
+
+static void _reader_exit(void)
+{
+    atomic_fetch_sub(&readers, 1);
+}
+
+/*
+** rx_ring_push() - store a received message (producer)
+**
+** returns the ring depth after the push, or -1 if the message was dropped
+*/
+int rx_ring_push(const struct RADIO_MSG *rxMsg)
+{
+    struct RADIO_MSG *ring = atomic_load(&slots);
+    uint32_t h, t, depth;
+
+    if (ring == NULL)
+        return -1;
+
+    h = atomic_load_explicit(&head, memory_order_relaxed);
+    t = atomic_load_explicit(&tail, memory_order_acquire);
+
+    if (h - t > mask)
+    {
+        // ring full
+        if (dropPolicy == RX_DROP_NEWEST)
+        {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            TRACE_OUTS("rx_ring_push(): full, newest dropped\n");
+            return -1;
+        }
+
+        // take the oldest message from the consumer, if this fails the consumer has just freed a slot for us
+        if (atomic_compare_exchange_strong_explicit(&tail, &t, t + 1, memory_order_acq_rel, memory_order_acquire))
+        {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            TRACE_OUTS("rx_ring_push(): full, oldest dropped\n");
+            t++;
+        }
+    }
+
+    memcpy(&ring[h & mask], rxMsg, sizeof(struct RADIO_MSG));
+    atomic_store_explicit(&head, h + 1, memory_order_release);
+    atomic_fetch_add_explicit(&enqueued, 1, memory_order_relaxed);
+
+    depth = h + 1 - t;
+    if (depth > atomic_load_explicit(&highWater, memory_order_relaxed))
+        atomic_store_explicit(&highWater, depth, memory_order_relaxed);
+
+    return (int)depth;
+}
+
+/*
+** rx_ring_pop() - returns next unread message from the ring (any consumer)
+**
+** returns -1 if no messages, or # of msgs remaining in ring
+*/
+int rx_ring_pop(struct RADIO_MSG *rxMsg)
+{
+    struct RADIO_MSG *ring;
+    uint32_t h, t;
+
+    if ((ring = _reader_enter()) == NULL)
+        return -1;
+
+    t = atomic_load_explicit(&tail, memory_order_acquire);
+    do
+    {
+        h = atomic_load_explicit(&head, memory_order_acquire);
+        if (h == t)
+        {
+            _reader_exit();
+            return -1;
+        }
+
+        memcpy(rxMsg, &ring[t & mask], sizeof(struct RADIO_MSG));
+
+        // claim the message, a failure means the producer dropped it whilst we were copying; t is reloaded
+    } while (!atomic_compare_exchange_weak_explicit(&tail, &t, t + 1, memory_order_acq_rel, memory_order_acquire));
+
+    _reader_exit();
+    return (int)(h - (t + 1));
+}
+
+/*
+** rx_ring_peek() - copy unread message msgNum (0 = oldest) without removing it from the ring
+**
+** returns the message timestamp, or -1 if there is no such message
+*/
+int rx_ring_peek(unsigned int msgNum, struct RADIO_MSG *rxMsg)
+{
+    struct RADIO_MSG *ring;
+    uint32_t h, t;
+
+    if ((ring = _reader_enter()) == NULL)
+        return -1;
+
+    t = atomic_load_explicit(&tail, memory_order_acquire);
+    h = atomic_load_explicit(&head, memory_order_acquire);
+    if (msgNum >= h - t)
+    {
+        _reader_exit();
+        return -1;
+    }
+
+    memcpy(rxMsg, &ring[(t + msgNum) & mask], sizeof(struct RADIO_MSG));
+
+    _reader_exit();
+    return (int)rxMsg->t;
+}
+
+unsigned int rx_ring_size(void)
+{
+    return (atomic_load(&slots) == NULL) ? 0 : mask + 1;
+}
+
+void rx_ring_stats(struct RX_RING_STATS *stats)
+{
+    stats->size = rx_ring_size();
+    stats->depth = atomic_load(&head) - atomic_load(&tail);
+    stats->enqueued = atomic_load(&enqueued);
+    stats->dropped = atomic_load(&dropped);
+    stats->highWater = atomic_load(&highWater);
+    stats->policy = dropPolicy;
+}
@@ -0,0 +1,38 @@
+/* rx_ring.h  Achronite
+ *
+ * Receive ring for raw radio messages, sits between the radio drain (producer) and the OpenThings decoders (consumers)
+ */
+
+#ifndef RX_RING_H
+#define RX_RING_H
+
+#include <stdint.h>
+#include "lock_radio.h"
+
+#define RX_RING_DEFAULT_SIZE 64
+#define RX_RING_MAX_SIZE     4096
+
+// What to do when a message arrives and the ring is full
+enum rxDropPolicy {RX_DROP_OLDEST = 0, RX_DROP_NEWEST = 1};
+
+struct RX_RING_STATS {
+    uint32_t size;          // number of slots (power of 2)
+    uint32_t depth;         // messages currently waiting
+    uint32_t enqueued;      // total messages stored
+    uint32_t dropped;       // total messages lost due to overflow
+    uint32_t highWater;     // maximum depth seen
+    enum rxDropPolicy policy;
+};
+
+/***** FUNCTION PROTOTYPES *****/
+int rx_ring_init(unsigned int size, enum rxDropPolicy policy);
+void rx_ring_free(void);
+int rx_ring_push(const struct RADIO_MSG *rxMsg);
+int rx_ring_pop(struct RADIO_MSG *rxMsg);
+int rx_ring_peek(unsigned int msgNum, struct RADIO_MSG *rxMsg);
+unsigned int rx_ring_size(void);
+void rx_ring_stats(struct RX_RING_STATS *stats);
+
+#endif
+
+/***** END OF FILE *****/
@@ -7,6 +7,7 @@
 #define _DELAY_H
 
 #include "system.h"
+#include <stdint.h>
 
 //#include <time.h>
 #include <sys/time.h> // Won't work on Arduino
@@ -19,6 +20,17 @@ void delayms(unsigned int ms);
 
 void delayus(unsigned int us);
 
+void delayns(unsigned int ns);
+
+// Calibrated timing, all times are CLOCK_MONOTONIC
+void delay_calibrate(void);
+
+uint64_t delay_now_ns(void);
+
+void delay_until_ns(uint64_t deadline);
+
+uint32_t delay_sleep_latency_ns(void);
+
 #endif
 
 /***** END OF FILE *****/
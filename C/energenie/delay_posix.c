@@ -1,67 +1,127 @@
 /* delay_posix.c  04/04/2016  D.J.Whale
  *
  * Delay routines for posix compliant standard libraries (not Arduino)
+ *
+ * All delays are measured against CLOCK_MONOTONIC.  Longer delays sleep with clock_nanosleep() to an absolute
+ * deadline, so they do not drift if the sleep is interrupted or overruns.  The scheduler wakes us some time after
+ * the deadline (nanosleep() delays at least 100uS in some cases), so delay_calibrate() measures this latency and
+ * delays shorter than it, or the tail end of longer delays, are made by spinning on the clock instead.
  */
 
 #include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
+#include <errno.h>
 
 #include "system.h"
 #include "delay.h"
 
-static struct timespec delay_1sec = {1, 0};    // 1sec, 0us
-static struct timespec delay_1ms  = {0, 1000}; // 0sec, 1000us
+#define NS_PER_SEC          1000000000ULL
+#define CALIBRATE_SAMPLES   8
+#define DEFAULT_LATENCY_NS  100000      // used until delay_calibrate() has been run
 
+static uint32_t sleep_latency_ns = DEFAULT_LATENCY_NS;
 
-void delaysec(uint8_t secs)
+
+uint64_t delay_now_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+
+/* Sleep until the monotonic deadline, spinning for the part of the wait that is shorter than the scheduler latency */
+
+void delay_until_ns(uint64_t deadline)
 {
-  while (secs-- != 0)
+  uint64_t now = delay_now_ns();
+  struct timespec ts;
+
+  if (deadline > now + sleep_latency_ns)
   {
-    delay(delay_1sec);
+    uint64_t wake = deadline - sleep_latency_ns;
+
+    ts.tv_sec = wake / NS_PER_SEC;
+    ts.tv_nsec = wake % NS_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
   }
+
+  while (delay_now_ns() < deadline)
+    ;
 }
 
 
-void delayms(unsigned int ms)
+/* Measure how late the shortest sleep wakes up, taking the best of a few samples */
+
+void delay_calibrate(void)
 {
-  while (ms-- > 0)
+  struct timespec ts = {0, 1000};
+  uint32_t best = DEFAULT_LATENCY_NS;
+  uint64_t start, took;
+  int i;
+
+  for (i = 0; i < CALIBRATE_SAMPLES; i++)
   {
-    delay(delay_1ms);
+    start = delay_now_ns();
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+    took = delay_now_ns() - start;
+    if (took < best)
+      best = (uint32_t)took;
   }
+
+  sleep_latency_ns = best;
 }
 
 
-void delay(struct timespec time)
+uint32_t delay_sleep_latency_ns(void)
 {
-  nanosleep(&time, NULL);
+  return sleep_latency_ns;
 }
 
 
-/* Based on code suggested by Gordon Henderson:
- * https://github.com/WiringPi/WiringPi/blob/master/wiringPi/wiringPi.c
- *
- * Note that his trick of using the hardware timer just didn't work,
- * and this is the best of a bad bunch. nanosleep() delays at least
- * 100uS in some cases.
- */
+void delaysec(uint8_t secs)
+{
+  delay_until_ns(delay_now_ns() + secs * NS_PER_SEC);
+}
+
+
+void delayms(unsigned int ms)
+{
+  delay_until_ns(delay_now_ns() + ms * 1000000ULL);
+}
+
+
+void delay(struct timespec time)
+{
+  delay_until_ns(delay_now_ns() + (uint64_t)time.tv_sec * NS_PER_SEC + (uint64_t)time.tv_nsec);
+}
 
 
 void delayus(unsigned int us)
 {
-  struct timeval tNow, tLong, tEnd;
+  if (us != 0)
+  {
+    delay_until_ns(delay_now_ns() + us * 1000ULL);
+  }
+}
 
-  gettimeofday(&tNow, NULL);
-  tLong.tv_sec  = us / 1000000;
-  tLong.tv_usec = us % 1000000;
-  timeradd(&tNow, &tLong, &tEnd);
 
-  while (timercmp(&tNow, &tEnd, <))
+/* Short delays for bit banging, always spins */
+
+void delayns(unsigned int ns)
+{
+  uint64_t deadline;
+
+  if (ns != 0)
   {
-    gettimeofday(&tNow, NULL);
+    deadline = delay_now_ns() + ns;
+    while (delay_now_ns() < deadline)
+      ;
   }
 }
 
 
 /***** END OF FILE *****/
-
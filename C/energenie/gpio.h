@@ -9,6 +9,7 @@
 #define GPIO_H
 
 #include "system.h"
+#include <stdint.h>
 
 extern const uint8_t gpio_sim; /* 0=> not simulated */
 
@@ -21,6 +22,7 @@ void    gpio_high(uint8_t g);
 void    gpio_low(uint8_t g);
 void    gpio_write(uint8_t g, uint8_t v);
 uint8_t gpio_read(uint8_t g);
+void    gpio_set_clear(uint32_t set, uint32_t clr);
 void    gpio_finished(void);
 
 /**** Bad return codes from gpio / spi ****/
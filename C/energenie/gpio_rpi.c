@@ -153,6 +153,21 @@ uint8_t gpio_read(uint8_t g)
 }
 
 
+/* Set and clear several pins with one write to each of the set and clear registers, (1<<g) for each pin */
+
+void gpio_set_clear(uint32_t set, uint32_t clr)
+{
+  if (set != 0)
+  {
+    GPIO_SET = set;
+  }
+  if (clr != 0)
+  {
+    GPIO_CLR = clr;
+  }
+}
+
+
 void gpio_finished(void)
 {
   //TODO probably need gpio_finished() to unmmap() the memory region and clean up the peripheral?
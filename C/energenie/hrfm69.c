@@ -18,11 +18,39 @@
 #include "spi.h"
 #include "trace.h"
 #include "gpio.h"
+#include "delay.h"
 #include "../achronite/leds.h"
 
+#define HRF_SPI_SPEED_HZ 9000000    // default until calibrated, 10MHz does not work on pi5 (so dropped to 9MHz)
+#define HRF_SPI_MAX_HZ   10000000   // RFM69 limit
+
+// SPI clock calibration, each speed (fastest first) must pass every round of write/readback of the unused sync
+// word registers SYNCVALUE3-8.  The speed chosen is saved per board model in HRF_SPI_CACHE (in $HOME, or the path
+// in $ENER314RT_SPI_CACHE) and only re-verified on later starts.
+#define HRF_CALIBRATE_ROUNDS 16
+#define HRF_CALIBRATE_LEN    (HRF_ADDR_SYNCVALUE8 - HRF_ADDR_SYNCVALUE3 + 1)
+#define HRF_SPI_CACHE        ".ener314rt-spi"
+static const uint32_t _spi_speeds[] = {HRF_SPI_MAX_HZ, 9000000, 8000000, 6000000, 4000000, 2000000, 1000000};
+
+// HRF_pollreg() limits
+#define HRF_POLL_TIMEOUT_US  100000
+#define HRF_POLL_INTERVAL_US 100
+
+// SPI self test, bursts reading the static config registers OPMODE (0x01) to 0x1D, these have no side effects
+// when read and do not change on their own
+#define HRF_SELFTEST_BURSTS 32
+#define HRF_SELFTEST_LEN    29
+
 /* globals*/
 static volatile bool _spi_hw_driver = false;
 static int _spi_hw_fd = 0;      // global
+static uint32_t _spi_speed_hz = HRF_SPI_SPEED_HZ;
+
+// Shadow copy of the radio registers we have written, so that config loads only write what has changed.
+// Registers the radio changes itself (FIFO, IRQ flags, OPMODE under AutoModes) are never shadowed
+static uint8_t _shadow[HRF_NUM_REGS];
+static bool _shadow_valid[HRF_NUM_REGS];
+static HRF_STATS _stats;
 
 /*---------------------------------------------------------------------------*/
 // Initialise radio hardware, SPI and GPIO
@@ -34,6 +62,7 @@ int HRF_spi_init(void){
 
     // initialise GPIO using gpiod (NOTE: gpiod is NOT used by the software SPI code, it uses the deprecated WiringPi interface)
     ret = leds_initialise();
+    delay_calibrate();
 
     if (ret == 0) {
         // Try using hardware SPI driver first
@@ -41,6 +70,7 @@ int HRF_spi_init(void){
         if (_spi_hw_fd < 0)
         {
             _spi_hw_driver = false;
+            _stats.hwDriver = false;
             printf("ener314rt: Cannot open /dev/spidev0.1 - Fallback to Software SPI driver\n");
 
             // Initialise wiringPi gpio separately for SPI
@@ -51,6 +81,8 @@ int HRF_spi_init(void){
             }
         } else {
             _spi_hw_driver = true;
+            _stats.hwDriver = true;
+            _stats.speedHz = _spi_speed_hz;
             printf("ener314rt: Hardware driver enabled on /dev/spidev0.1\n");
             // Set SPI mode
             // Open the SPI interface.
@@ -74,7 +106,7 @@ int HRF_spi_init(void){
                 ret = ioctl(_spi_hw_fd, SPI_IOC_WR_BITS_PER_WORD, &spiWordLen);
 
                 // Set SPI speed
-                uint32_t spiSpeed   = 10000000;
+                uint32_t spiSpeed   = HRF_SPI_MAX_HZ;
                 ret = ioctl(_spi_hw_fd, SPI_IOC_WR_MAX_SPEED_HZ, &spiSpeed);
                 if (ret != 0){
                     printf("ener314rt: ioctl failed SPI_IOC_WR_MODE\n");
@@ -89,7 +121,7 @@ int HRF_spi_init(void){
 
 /*---------------------------------------------------------------------------*/
 // Private function that perform all communication with radio adaptor after initialisation using the appropriate interface.
-// This requires all buffers to be malloced before calling, allowing +1 length for command
+// This requires all buffers to be allocated before calling, allowing +1 length for command
 // Command must be populated in txbuf[0] before calling
 //
 // Achronite: Jan 2023
@@ -97,6 +129,8 @@ int HRF_spi_init(void){
 uint8_t _HRF_xfer( uint8_t* txbuf, uint8_t* rxbuf, uint8_t len )
 {
     int status = 0;
+
+    _stats.xfers++;
     if (_spi_hw_driver){
         // hardware driver
 
@@ -107,7 +141,7 @@ uint8_t _HRF_xfer( uint8_t* txbuf, uint8_t* rxbuf, uint8_t len )
         xfer.tx_buf        = (uintptr_t)txbuf;
         xfer.rx_buf        = (uintptr_t)rxbuf;
         //xfer.delay_usecs   = 0;
-        xfer.speed_hz      = 9000000;   // 10MHz does not work on pi5 (so dropped to 9MHz)
+        xfer.speed_hz      = _spi_speed_hz;
         xfer.bits_per_word = 8;
         xfer.len           = len;
         //xfer.cs_change     = 0;
@@ -138,6 +172,14 @@ uint8_t _HRF_xfer( uint8_t* txbuf, uint8_t* rxbuf, uint8_t len )
 
 }
 
+/*---------------------------------------------------------------------------*/
+// Registers that only change when we write them can be shadowed
+
+static bool _HRF_shadowed(uint8_t addr)
+{
+    return addr < HRF_NUM_REGS && addr != HRF_ADDR_FIFO && addr != HRF_ADDR_OPMODE && addr != HRF_ADDR_IRQFLAGS1 && addr != HRF_ADDR_IRQFLAGS2;
+}
+
 /*---------------------------------------------------------------------------*/
 // Write an 8 bit value to a register
 
@@ -170,11 +212,216 @@ void HRF_writereg(uint8_t addr, uint8_t data)
         TRACE_OUTS("HRF_writereg(): Failed. status=");
         TRACE_OUTN(status);
         TRACE_NL();
+        _shadow_valid[addr] = false;
+    } else if (_HRF_shadowed(addr)) {
+        _shadow[addr] = data;
+        _shadow_valid[addr] = true;
     }
 	return;
 }
 
 
+/*---------------------------------------------------------------------------*/
+// Write an 8 bit value to a register, only if the shadow copy shows it is not already set
+
+void HRF_writereg_delta(uint8_t addr, uint8_t data)
+{
+    if (_HRF_shadowed(addr) && _shadow_valid[addr] && _shadow[addr] == data){
+        _stats.writesSaved++;
+        return;
+    }
+    HRF_writereg(addr, data);
+}
+
+
+/*---------------------------------------------------------------------------*/
+// Forget the shadow copy, must be called whenever the radio is reset
+
+void HRF_shadow_invalidate(void)
+{
+    memset(_shadow_valid, 0, sizeof(_shadow_valid));
+}
+
+/*---------------------------------------------------------------------------*/
+// Write every register held in the shadow copy back to the radio, used to reload the config after a reset
+
+void HRF_shadow_restore(void)
+{
+    HRF_BATCH batch;
+    int addr;
+
+    HRF_batch_init(&batch);
+    for (addr = 0; addr < HRF_NUM_REGS; addr++){
+        if (_shadow_valid[addr]){
+            if (HRF_batch_writereg(&batch, addr, _shadow[addr]) < 0){
+                // batch full, send what we have and carry on
+                HRF_batch_submit(&batch);
+                HRF_batch_writereg(&batch, addr, _shadow[addr]);
+            }
+        }
+    }
+    HRF_batch_submit(&batch);
+}
+
+
+/*---------------------------------------------------------------------------*/
+
+void HRF_get_stats(HRF_STATS* stats)
+{
+    *stats = _stats;
+}
+
+/*---------------------------------------------------------------------------*/
+// Write and read back patterns in the unused sync word registers at the current speed
+
+static bool _HRF_spi_verify(void)
+{
+    uint8_t txbuf[HRF_CALIBRATE_LEN + 1];
+    uint8_t rxbuf[HRF_CALIBRATE_LEN + 1];
+    int round, i;
+
+    for (round = 0; round < HRF_CALIBRATE_ROUNDS; round++){
+        // alternate all-bits patterns with ones that change every byte
+        txbuf[0] = HRF_ADDR_SYNCVALUE3 | HRF_MASK_WRITE_DATA;
+        for (i = 1; i <= HRF_CALIBRATE_LEN; i++){
+            txbuf[i] = (round & 1) ? (uint8_t)(round * 37 + i * 0x5B) : ((round & 2) ? 0xAA : 0x55) ^ (i & 1 ? 0xFF : 0);
+        }
+        if (_HRF_xfer(txbuf, NULL, sizeof(txbuf)) != sizeof(txbuf)){
+            return false;
+        }
+
+        memset(rxbuf, 0, sizeof(rxbuf));
+        rxbuf[0] = HRF_ADDR_SYNCVALUE3;
+        if (_HRF_xfer(rxbuf, rxbuf, sizeof(rxbuf)) != sizeof(rxbuf) ||
+            memcmp(&txbuf[1], &rxbuf[1], HRF_CALIBRATE_LEN) != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _HRF_spi_cache_path(char* path, size_t len)
+{
+    const char* env = getenv("ENER314RT_SPI_CACHE");
+    const char* home = getenv("HOME");
+
+    if (env != NULL){
+        snprintf(path, len, "%s", env);
+    } else {
+        snprintf(path, len, "%s/%s", home ? home : "/tmp", HRF_SPI_CACHE);
+    }
+}
+
+static void _HRF_board_model(char* model, size_t len)
+{
+    FILE* fp;
+    size_t n = 0;
+
+    if ((fp = fopen("/proc/device-tree/model", "r")) != NULL){
+        n = fread(model, 1, len - 1, fp);
+        fclose(fp);
+    }
+    model[n] = '\0';
+    // the model is NUL terminated in the device tree, stop at anything that is not printable
+    for (n = 0; model[n] != '\0'; n++){
+        if (model[n] < ' ' || model[n] > '~'){
+            model[n] = '\0';
+            break;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+// Pick the fastest hardware SPI clock that reliably reads back what was written.  A speed saved for this board model
+// is used if it still verifies, otherwise each speed is tried from fastest down and the result saved.
+// Returns the chosen speed in Hz, or 0 if no speed worked (or software SPI is in use)
+
+uint32_t HRF_spi_calibrate(void)
+{
+    char path[256], model[128], savedModel[128];
+    unsigned int saved = 0;
+    uint32_t chosen = 0;
+    unsigned int i;
+    FILE* fp;
+
+    if (!_spi_hw_driver){
+        return 0;
+    }
+
+    _HRF_board_model(model, sizeof(model));
+    _HRF_spi_cache_path(path, sizeof(path));
+
+    if ((fp = fopen(path, "r")) != NULL){
+        if (fscanf(fp, "%u %127[^\n]", &saved, savedModel) == 2 && strcmp(model, savedModel) == 0 &&
+            saved > 0 && saved <= HRF_SPI_MAX_HZ){
+            _spi_speed_hz = saved;
+            if (_HRF_spi_verify()){
+                chosen = saved;
+            }
+        }
+        fclose(fp);
+    }
+
+    if (chosen == 0){
+        for (i = 0; i < sizeof(_spi_speeds) / sizeof(_spi_speeds[0]); i++){
+            _spi_speed_hz = _spi_speeds[i];
+            if (_HRF_spi_verify()){
+                chosen = _spi_speeds[i];
+                break;
+            }
+        }
+
+        if (chosen != 0 && (fp = fopen(path, "w")) != NULL){
+            fprintf(fp, "%u %s\n", chosen, model);
+            fclose(fp);
+        }
+    }
+
+    if (chosen == 0){
+        TRACE_FAIL("HRF_spi_calibrate(): no reliable SPI speed found\n");
+        _spi_speed_hz = HRF_SPI_SPEED_HZ;
+    }
+
+    // the sync word registers were written behind the shadow copy's back
+    for (i = HRF_ADDR_SYNCVALUE3; i <= HRF_ADDR_SYNCVALUE8; i++){
+        _shadow_valid[i] = false;
+    }
+
+    _stats.speedHz = _spi_speed_hz;
+    return chosen;
+}
+
+/*---------------------------------------------------------------------------*/
+// Measure the SPI throughput by reading the config registers a number of times, checking that every read agrees
+// Returns the achieved kbit/s, or -1 if the reads were inconsistent (wiring or timing problem)
+
+int HRF_spi_selftest(void)
+{
+    uint8_t txbuf[HRF_SELFTEST_LEN + 1] = {HRF_ADDR_OPMODE};
+    uint8_t first[HRF_SELFTEST_LEN + 1];
+    uint8_t rxbuf[HRF_SELFTEST_LEN + 1];
+    uint64_t start, took;
+    int i;
+
+    _HRF_xfer(txbuf, first, sizeof(txbuf));
+
+    start = delay_now_ns();
+    for (i = 0; i < HRF_SELFTEST_BURSTS; i++){
+        if (_HRF_xfer(txbuf, rxbuf, sizeof(txbuf)) != sizeof(txbuf) ||
+            memcmp(&first[1], &rxbuf[1], HRF_SELFTEST_LEN) != 0){
+            TRACE_FAIL("HRF_spi_selftest(): register reads inconsistent\n");
+            _stats.kbps = 0;
+            return -1;
+        }
+    }
+    took = delay_now_ns() - start;
+
+    // bits / ns * 10^6 = kbit/s
+    _stats.kbps = (uint32_t)((uint64_t)HRF_SELFTEST_BURSTS * sizeof(txbuf) * 8 * 1000000ULL / (took ? took : 1));
+    return (int)_stats.kbps;
+}
+
+
 /*---------------------------------------------------------------------------*/
 // Read an 8 bit value from a register
 
@@ -199,6 +446,186 @@ uint8_t HRF_readreg(uint8_t addr)
 }
 
 
+/*---------------------------------------------------------------------------*/
+// Read len consecutive registers starting at addr, in a single burst (the radio auto-increments the address)
+
+HRF_RESULT HRF_readreg_burst(uint8_t addr, uint8_t* buf, uint8_t len)
+{
+    int status = 0;
+    uint8_t txbuf[HRF_MAX_REG_BURST + 1] = {0};
+    uint8_t rxbuf[HRF_MAX_REG_BURST + 1] = {0};
+
+    if (len > HRF_MAX_REG_BURST){
+        return HRF_RESULT_ERR_BUFFER_TOO_SMALL;
+    }
+
+    txbuf[0] = addr;
+
+    status = _HRF_xfer( txbuf, rxbuf, (len + 1) );
+
+    if (status != (len + 1)){
+        TRACE_OUTS("HRF_readreg_burst(): Failed. status=");
+        TRACE_OUTN(status);
+        TRACE_NL();
+        return HRF_RESULT_ERR_READ_FAILED;
+    }
+
+    memcpy( buf, &rxbuf[1], len );
+    return HRF_RESULT_OK;
+}
+
+
+/*---------------------------------------------------------------------------*/
+// Transaction builder, queue register operations with HRF_batch_xxx() then send them all with HRF_batch_submit()
+// Reads and bursts return the operation index (for HRF_batch_result()) and writes return 0, all return -1 if the
+// batch is full
+
+void HRF_batch_init(HRF_BATCH* batch)
+{
+    batch->count = 0;
+}
+
+int HRF_batch_burst(HRF_BATCH* batch, uint8_t* txbuf, uint8_t* rxbuf, uint8_t len)
+{
+    int i = batch->count;
+
+    if (i >= HRF_MAX_BATCH){
+        TRACE_FAIL("HRF_batch(): batch full\n");
+        return -1;
+    }
+
+    batch->op[i].tx = txbuf;
+    batch->op[i].rx = rxbuf;
+    batch->op[i].len = len;
+    batch->op[i].shadow = false;
+    batch->count++;
+
+    return i;
+}
+
+int HRF_batch_writereg(HRF_BATCH* batch, uint8_t addr, uint8_t data)
+{
+    int i = HRF_batch_burst(batch, NULL, NULL, 2);
+
+    if (i < 0){
+        return -1;
+    }
+
+    batch->reg_tx[i][0] = addr | HRF_MASK_WRITE_DATA;
+    batch->reg_tx[i][1] = data;
+    batch->op[i].tx = batch->reg_tx[i];
+    batch->op[i].shadow = _HRF_shadowed(addr);
+
+    return 0;
+}
+
+int HRF_batch_writereg_delta(HRF_BATCH* batch, uint8_t addr, uint8_t data)
+{
+    if (_HRF_shadowed(addr) && _shadow_valid[addr] && _shadow[addr] == data){
+        _stats.writesSaved++;
+        return 0;
+    }
+    return HRF_batch_writereg(batch, addr, data);
+}
+
+int HRF_batch_readreg(HRF_BATCH* batch, uint8_t addr)
+{
+    int i = HRF_batch_burst(batch, NULL, NULL, 2);
+
+    if (i >= 0){
+        batch->reg_tx[i][0] = addr;
+        batch->reg_tx[i][1] = 0;
+        batch->reg_rx[i][1] = 0;
+        batch->op[i].tx = batch->reg_tx[i];
+        batch->op[i].rx = batch->reg_rx[i];
+    }
+
+    return i;
+}
+
+// value read by a HRF_batch_readreg() operation
+uint8_t HRF_batch_result(const HRF_BATCH* batch, int op)
+{
+    return batch->reg_rx[op][1];
+}
+
+HRF_RESULT HRF_batch_submit(HRF_BATCH* batch)
+{
+    int i, j;
+    int total = 0;
+    int status = 0;
+
+    if (batch->count == 0){
+        return HRF_RESULT_OK;
+    }
+
+    _stats.xfers++;
+    _stats.batchedOps += batch->count;
+
+    for (i = 0; i < batch->count; i++){
+        total += batch->op[i].len;
+    }
+
+    if (_spi_hw_driver){
+        // hardware driver, one ioctl for the whole batch, deselecting between each operation
+        struct spi_ioc_transfer xfer[HRF_MAX_BATCH];
+        memset(xfer, 0, sizeof(xfer));
+
+        for (i = 0; i < batch->count; i++){
+            xfer[i].tx_buf        = (uintptr_t)batch->op[i].tx;
+            xfer[i].rx_buf        = (uintptr_t)batch->op[i].rx;
+            xfer[i].len           = batch->op[i].len;
+            xfer[i].speed_hz      = _spi_speed_hz;
+            xfer[i].bits_per_word = 8;
+            xfer[i].cs_change     = (i + 1 < batch->count);
+        }
+
+        status = ioctl(_spi_hw_fd, SPI_IOC_MESSAGE(batch->count), xfer);
+
+    } else {
+        // software driver, same sequence one operation at a time
+        uint8_t rxByte = 0;
+
+        for (i = 0; i < batch->count; i++){
+            spi_select();
+            for (j = 0; j < batch->op[i].len; j++){
+                rxByte = spi_byte(batch->op[i].tx[j]);
+                if (batch->op[i].rx){
+                    batch->op[i].rx[j] = rxByte;
+                }
+            }
+            spi_deselect();
+        }
+        status = total;
+    }
+
+    if (status != total){
+        TRACE_OUTS("HRF_batch_submit(): Failed. status=");
+        TRACE_OUTN(status);
+        TRACE_NL();
+        // we no longer know what was written
+        for (i = 0; i < batch->count; i++){
+            if (batch->op[i].shadow){
+                _shadow_valid[batch->op[i].tx[0] & ~HRF_MASK_WRITE_DATA] = false;
+            }
+        }
+        batch->count = 0;
+        return HRF_RESULT_ERR_READ_FAILED;
+    }
+
+    for (i = 0; i < batch->count; i++){
+        if (batch->op[i].shadow){
+            uint8_t addr = batch->op[i].tx[0] & ~HRF_MASK_WRITE_DATA;
+            _shadow[addr] = batch->op[i].tx[1];
+            _shadow_valid[addr] = true;
+        }
+    }
+    batch->count = 0;
+
+    return HRF_RESULT_OK;
+}
+
+
 /*---------------------------------------------------------------------------*/
 // Write all bytes in buf to the payload FIFO, in a single burst
 
@@ -206,8 +633,13 @@ void HRF_writefifo_burst(uint8_t* buf, uint8_t len)
 {
     int status = 0;
 
-    // allocate a tx buffer, adding 1 to length for the instruction to beginning
-    uint8_t *txbuf = (uint8_t*)malloc((len + 1) * sizeof(uint8_t));
+    // tx buffer, adding 1 to length for the instruction to beginning (on the stack, this is on the Tx hot path)
+    uint8_t txbuf[HRF_MAX_FIFO + 1];
+
+    if (len > HRF_MAX_FIFO){
+        TRACE_FAIL("HRF_writefifo_burst(): payload larger than FIFO\n");
+        return;
+    }
 
     // 1st byte needs to be the instruction
     txbuf[0] = HRF_ADDR_FIFO | HRF_MASK_WRITE_DATA;     // write FIFO
@@ -220,8 +652,6 @@ void HRF_writefifo_burst(uint8_t* buf, uint8_t len)
         TRACE_OUTN(status);
         TRACE_NL();
     }
-	
-    free(txbuf);
 	return;
 }
 
@@ -241,8 +671,13 @@ HRF_RESULT HRF_readfifo_burst_cbp(uint8_t* buf, uint8_t buflen)
 {
     int status = 0;
 
-    // add 1 to length to cater for instruction to beginning
-    uint8_t *txbuf = (uint8_t*)calloc((buflen + 1), sizeof(uint8_t));
+    // add 1 to length to cater for instruction to beginning (on the stack, this is on the Rx hot path)
+    uint8_t txbuf[HRF_MAX_FIFO + 1] = {0};
+
+    // the count byte is returned in buf[0], so payloads are limited to buflen-1 bytes
+    if (buflen > HRF_MAX_FIFO){
+        buflen = HRF_MAX_FIFO;
+    }
 
     // 1st byte needs to be the command
 	txbuf[0] = HRF_ADDR_FIFO;
@@ -254,7 +689,7 @@ HRF_RESULT HRF_readfifo_burst_cbp(uint8_t* buf, uint8_t buflen)
 
         uint8_t payload_len = buf[1];
 
-        if (payload_len > 5 && payload_len <= buflen){
+        if (payload_len > 5 && payload_len < buflen){
             // content length within range, read the rest of the payload
             status = _HRF_xfer( txbuf, buf, payload_len+1 );
 
@@ -293,8 +728,6 @@ HRF_RESULT HRF_readfifo_burst_cbp(uint8_t* buf, uint8_t buflen)
         TRACE_NL();
     #endif
 
-    free(txbuf);
-
     return HRF_RESULT_OK;
 }
 
@@ -353,33 +786,46 @@ HRF_RESULT HRF_checkreg(uint8_t addr, uint8_t mask, uint8_t value)
 
 
 /*---------------------------------------------------------------------------*/
-// Poll a register until it meets some criteria
+// Poll a register until it meets some criteria, giving up after HRF_POLL_TIMEOUT_US so that a wedged radio cannot
+// hang the caller.  Mode changes are usually complete within a few hundred us so the poll interval is short.
 
-void HRF_pollreg(uint8_t addr, uint8_t mask, uint8_t value)
+HRF_RESULT HRF_pollreg(uint8_t addr, uint8_t mask, uint8_t value)
 {
+    uint64_t deadline = delay_now_ns() + HRF_POLL_TIMEOUT_US * 1000ULL;
+
     while (! HRF_checkreg(addr, mask, value))
     {
-      // busy wait
-      //TODO: No timeout or error recovery? Can cause permanent lockup
       #if defined(FULLTRACE)
         TRACE_OUTC('P');
       #endif
 
-      // added the best sleep function for linux OS, transmit usually takes 40-60ms, sleep 20ms = 20,000,000ns
-      nanosleep((const struct timespec[]){{0, 20000000L}}, NULL);
+      if (delay_now_ns() > deadline)
+      {
+        TRACE_FAIL("HRF_pollreg(): timed out\n");
+        _stats.pollTimeouts++;
+        return HRF_RESULT_ERR_TIMEOUT;
+      }
+      delayus(HRF_POLL_INTERVAL_US);
     }
+    return HRF_RESULT_OK;
 }
 
 
 /*---------------------------------------------------------------------------*/
 // Clear any data in the HRF payload FIFO, by reading until empty
+// Bounded by the FIFO size in case the radio has crashed and SPI always returns a stuck flag bit
 
 void HRF_clear_fifo(void)
 {
-    //TODO: max fifolen is 66, should bail after that to prevent lockup
-    //especially if radio crashed and SPI always returns stuck flag bit
+    int i = 0;
+
     while ((HRF_readreg(HRF_ADDR_IRQFLAGS2) & HRF_MASK_FIFONOTEMPTY) == HRF_MASK_FIFONOTEMPTY)
     {
+        if (i++ >= HRF_MAX_FIFO)
+        {
+            TRACE_FAIL("HRF_clear_fifo(): FIFO did not empty\n");
+            break;
+        }
         HRF_readreg(HRF_ADDR_FIFO);
     }
 }
@@ -12,6 +12,8 @@
 #define _HRF69_H
 
 #include "system.h"
+#include <stdint.h>
+#include <stdbool.h>
 
 typedef uint8_t HRF_RESULT;
 //consider these, so we can easily pass back a boolean too
@@ -19,6 +21,43 @@ typedef uint8_t HRF_RESULT;
 #define HRF_RESULT_OK_FALSE             0x00
 #define HRF_RESULT_OK_TRUE              0x01
 #define HRF_RESULT_ERR_BUFFER_TOO_SMALL 0x81
+#define HRF_RESULT_ERR_READ_FAILED      0x82
+#define HRF_RESULT_ERR_TIMEOUT          0x83
+
+#define HRF_MAX_REG_BURST               8       // most registers read by HRF_readreg_burst()
+#define HRF_NUM_REGS                    0x80    // size of the register file, used for the shadow copy
+#define HRF_MAX_FIFO                    66      // size of the radio FIFO
+
+#define HRF_MAX_BATCH                   16      // most operations in one HRF_BATCH
+
+// SPI counters
+typedef struct
+{
+  uint32_t xfers;           // SPI transactions made (a batch is one transaction)
+  uint32_t batchedOps;      // register operations carried in batches
+  uint32_t writesSaved;     // register writes skipped as the shadow copy showed the value was already set
+  uint32_t pollTimeouts;    // HRF_pollreg() calls that gave up
+  uint32_t kbps;            // throughput measured by HRF_spi_selftest()
+  uint32_t speedHz;         // hardware SPI clock chosen by HRF_spi_calibrate()
+  bool hwDriver;            // using spidev rather than software SPI
+} HRF_STATS;
+
+// A batch of register operations submitted to the radio in one SPI transaction (SPI_IOC_MESSAGE(n)), chip select
+// is toggled between each operation.  Single register operations use the buffers in the batch, bursts use the
+// caller's buffers which must remain valid until HRF_batch_submit() returns.
+typedef struct
+{
+  uint8_t count;
+  uint8_t reg_tx[HRF_MAX_BATCH][2];
+  uint8_t reg_rx[HRF_MAX_BATCH][2];
+  struct
+  {
+    uint8_t* tx;
+    uint8_t* rx;
+    uint8_t  len;
+    bool     shadow;        // op is a register write to record in the shadow copy once submitted
+  } op[HRF_MAX_BATCH];
+} HRF_BATCH;
 
 typedef struct
 {
@@ -43,6 +82,13 @@ typedef struct
 #define HRF_ADDR_LNA                   0x18
 #define HRF_ADDR_RXBW                  0x19
 #define HRF_ADDR_AFCFEI                0x1E
+#define HRF_ADDR_AFCMSB                0x1F
+#define HRF_ADDR_AFCLSB                0x20
+#define HRF_ADDR_FEIMSB                0x21
+#define HRF_ADDR_FEILSB                0x22
+#define HRF_ADDR_RSSICONFIG            0x23
+#define HRF_ADDR_RSSIVALUE             0x24
+#define HRF_ADDR_DIOMAPPING1           0x25
 #define HRF_ADDR_IRQFLAGS1             0x27
 #define HRF_ADDR_IRQFLAGS2             0x28
 #define HRF_ADDR_RSSITHRESH            0x29
@@ -67,16 +113,22 @@ typedef struct
 #define HRF_MASK_REGDATAMODUL_FSK      0x00
 #define HRF_MASK_WRITE_DATA            0x80
 #define HRF_MASK_MODEREADY             0x80
+#define HRF_MASK_RXREADY               0x40
 #define HRF_MASK_FIFONOTEMPTY          0x40
 #define HRF_MASK_FIFOLEVEL             0x20
 #define HRF_MASK_FIFOOVERRUN           0x10
+#define HRF_MASK_TXSTARTNOTEMPTY       0x80	// FIFOTHRESH: start transmission when FIFO not empty, rather than on FifoLevel
 #define HRF_MASK_PACKETSENT            0x08
 #define HRF_MASK_TXREADY               0x20
 #define HRF_MASK_PACKETMODE            0x60
 #define HRF_MASK_MODULATION            0x18
 #define HRF_MASK_PAYLOADRDY            0x04
 
+// Frequency synthesizer step (FXOSC / 2^19) in Hz, used to scale AFC and FEI values
+#define HRF_FSTEP_HZ                   61.03515625
+
 // Radio modes
+#define HRF_MASK_MODE                  0x1C	// OPMODE Mode bits
 #define HRF_MODE_STANDBY               0x04	// Standby
 #define HRF_MODE_TRANSMITTER           0x0C	// Transmiter
 #define HRF_MODE_RECEIVER              0x10	// Receiver
@@ -112,7 +164,10 @@ typedef struct
 #define HRF_VAL_PAYLOADLEN66           66	// max Length in RX, not used in Tx
 #define HRF_VAL_FIFOTHRESH1            0x81	// Condition to start packet transmission: at least one byte in FIFO
 #define HRF_VAL_FIFOTHRESH30           0x1E	// Condition to start packet transmission: wait for 30 bytes in FIFO
+#define HRF_VAL_DIOMAPPING1_PAYLOADRDY 0x40	// DIO0 = PayloadReady in Rx (TxReady in Tx)
 #define HRF_VAL_AUTORX                 0x85 // see below                 
+#define HRF_VAL_AUTOTX                 0x5B // IntermediateMode = Tx, Enter = rising FifoLevel, Exit = PacketSent = 010 110 11 (used from Stdby)
+#define HRF_VAL_AUTOMODES_OFF          0x00
 
 /* RegAutoModes (0x3B)
 Automatic reception (AutoRx) :
@@ -144,12 +199,26 @@ x 01 → Standby mode (STDBY)
 
 
 void HRF_writereg(uint8_t addr, uint8_t data);
+void HRF_writereg_delta(uint8_t addr, uint8_t data);
+void HRF_shadow_invalidate(void);
+void HRF_shadow_restore(void);
+void HRF_get_stats(HRF_STATS* stats);
+int HRF_spi_selftest(void);
+uint32_t HRF_spi_calibrate(void);
+void HRF_batch_init(HRF_BATCH* batch);
+int HRF_batch_writereg(HRF_BATCH* batch, uint8_t addr, uint8_t data);
+int HRF_batch_writereg_delta(HRF_BATCH* batch, uint8_t addr, uint8_t data);
+int HRF_batch_readreg(HRF_BATCH* batch, uint8_t addr);
+int HRF_batch_burst(HRF_BATCH* batch, uint8_t* txbuf, uint8_t* rxbuf, uint8_t len);
+HRF_RESULT HRF_batch_submit(HRF_BATCH* batch);
+uint8_t HRF_batch_result(const HRF_BATCH* batch, int op);
 uint8_t HRF_readreg(uint8_t addr);
+HRF_RESULT HRF_readreg_burst(uint8_t addr, uint8_t* buf, uint8_t len);
 void HRF_writefifo_burst(uint8_t* buf, uint8_t len);
 HRF_RESULT HRF_readfifo_burst_cbp(uint8_t* buf, uint8_t buflen);
 //unused HRF_RESULT HRF_readfifo_burst_len(uint8_t* buf, uint8_t buflen);
 HRF_RESULT HRF_checkreg(uint8_t addr, uint8_t mask, uint8_t value);
-void HRF_pollreg(uint8_t addr, uint8_t mask, uint8_t value);
+HRF_RESULT HRF_pollreg(uint8_t addr, uint8_t mask, uint8_t value);
 void HRF_clear_fifo(void);
 
 // PTG New
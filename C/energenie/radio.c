@@ -30,6 +30,9 @@
 
 /***** INCLUDES *****/
 
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
 #include "system.h"
 #include "radio.h"
 #include "delay.h"
@@ -50,6 +53,20 @@
 #define RADIO_VAL_PACKETCONFIG1FSK       0xA2	// Variable length, Manchester coding, Addr must match NodeAddress
 #define RADIO_VAL_PACKETCONFIG1FSKNO 0xA0 // Variable length, Manchester coding
 
+// Time for the radio to start up after a reset
+#define RADIO_RESET_SETTLE_MS 5
+
+// Airtime, both modulations run at 4800b/s.  FSK payloads are Manchester coded (2 bits on air per data bit) and
+// each packet has the default 3 byte preamble and 2 byte sync word added by the packet engine.
+#define RADIO_BITRATE         4800
+#define RADIO_FSK_OVERHEAD    5
+// One Manchester coded byte, still being sent from the shift register once the FIFO has emptied
+#define RADIO_FSK_BYTE_US     (16 * 1000000 / RADIO_BITRATE)
+// How often the FIFO flags are checked once the expected airtime has passed
+#define RADIO_TXPOLL_US       500
+// Give up waiting on the FIFO this long after it should have emptied
+#define RADIO_TXSLACK_US      50000
+
 /* GPIO assignments for Raspberry Pi using BCM numbering */
 //#define RESET 25
 // GREEN used for RX, RED used for TX
@@ -61,6 +78,11 @@ static void _change_mode(uint8_t mode);
 static void _wait_ready(void);
 static void _wait_txready(void);
 static void _config(HRF_CONFIG_REC *config, uint8_t len);
+static uint32_t _elapsed_us(const struct timespec *from);
+static void _record_blind(const struct timespec *sent);
+static void _send_payload_automodes(uint8_t *payload, uint8_t len, uint8_t times);
+static uint32_t _airtime_us(uint8_t len, uint32_t frames);
+static bool _wait_fifo(uint8_t mask, uint8_t value, uint32_t expect_us);
 
 //----- ENERGENIE SPECIFIC CONFIGURATIONS --------------------------------------
 
@@ -72,7 +94,8 @@ static HRF_CONFIG_REC config_Shared[] = {
     {HRF_ADDR_SYNCVALUE1, RADIO_VAL_SYNCVALUE1FSK},         // 1st byte of Sync word
     {HRF_ADDR_SYNCVALUE2, RADIO_VAL_SYNCVALUE2FSK},         // 2nd byte of Sync word
     {HRF_ADDR_NODEADDRESS, 0x04},                           // Node address used in address filtering (not used) - PTG was 0x06 gpbenton uses 0x04
-    {HRF_ADDR_FIFOTHRESH, 	HRF_VAL_FIFOTHRESH1}		// RE-ADD - Condition to start packet transmission: at least one byte in FIFO
+    {HRF_ADDR_FIFOTHRESH, 	HRF_VAL_FIFOTHRESH1},		// RE-ADD - Condition to start packet transmission: at least one byte in FIFO
+    {HRF_ADDR_DIOMAPPING1, HRF_VAL_DIOMAPPING1_PAYLOADRDY}   // DIO0 raised on PayloadReady, used for interrupt driven Rx
 };
 #define CONFIG_SHARED_COUNT (sizeof(config_Shared) / sizeof(HRF_CONFIG_REC))
 
@@ -121,19 +144,31 @@ typedef struct
 
 RADIO_DATA radio_data = {RADIO_UNKNOWN,RADIO_UNKNOWN};
 
+static RADIO_TX_STATS tx_stats;
+static bool radio_fault = false;        // the radio failed to respond as expected, see radio_check_health()
+
 /***** PRIVATE ***************************************************************/
 
 /*---------------------------------------------------------------------------*/
-// Load a table of configuration values into HRF registers
+// Load a table of configuration values into HRF registers, skipping any that are already set, in one transaction
 
 static void _config(HRF_CONFIG_REC *config, uint8_t count)
 {
+    HRF_BATCH batch;
+
     _wait_ready();
+    HRF_batch_init(&batch);
     while (count-- != 0)
     {
-        HRF_writereg(config->addr, config->value);
+        if (HRF_batch_writereg_delta(&batch, config->addr, config->value) < 0)
+        {
+            // batch full, send what we have and carry on
+            HRF_batch_submit(&batch);
+            HRF_batch_writereg_delta(&batch, config->addr, config->value);
+        }
         config++;
     }
+    HRF_batch_submit(&batch);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -141,14 +176,30 @@ static void _config(HRF_CONFIG_REC *config, uint8_t count)
 
 static void _change_mode(uint8_t mode)
 {
-    HRF_writereg(HRF_ADDR_OPMODE, mode);
-    _wait_ready();
+    HRF_BATCH batch;
+    uint8_t ready = HRF_MASK_MODEREADY;
+    uint8_t irqflags1;
+    int op;
+
+    if (mode == HRF_MODE_TRANSMITTER)
+        ready |= HRF_MASK_TXREADY;
+
+    // set the mode and read the flags in the same transaction, short mode changes are often complete by then
+    HRF_batch_init(&batch);
+    HRF_batch_writereg(&batch, HRF_ADDR_OPMODE, mode);
+    op = HRF_batch_readreg(&batch, HRF_ADDR_IRQFLAGS1);
+    HRF_batch_submit(&batch);
+    irqflags1 = HRF_batch_result(&batch, op);
+
+    if ((irqflags1 & ready) != ready)
+        _wait_ready();
     //gpio_low(LED_RX); // RX OFF
     //gpio_low(LED_TX); // TX OFF
 
     if (mode == HRF_MODE_TRANSMITTER)
     {
-        _wait_txready();
+        if ((irqflags1 & ready) != ready)
+            _wait_txready();
         //gpio_high(LED_TX);  // TX ON
         leds_Tx();
     }
@@ -170,7 +221,8 @@ static void _wait_ready(void)
     #if defined(FULLTRACE)
         TRACE_OUTS("_wait_ready(): ");
     # endif
-    HRF_pollreg(HRF_ADDR_IRQFLAGS1, HRF_MASK_MODEREADY, HRF_MASK_MODEREADY);
+    if (HRF_pollreg(HRF_ADDR_IRQFLAGS1, HRF_MASK_MODEREADY, HRF_MASK_MODEREADY) != HRF_RESULT_OK)
+        radio_fault = true;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -181,7 +233,157 @@ static void _wait_txready(void)
     #if defined(FULLTRACE)
         TRACE_OUTS("_wait_txready\n");
     #endif
-    HRF_pollreg(HRF_ADDR_IRQFLAGS1, HRF_MASK_MODEREADY | HRF_MASK_TXREADY, HRF_MASK_MODEREADY | HRF_MASK_TXREADY);
+    if (HRF_pollreg(HRF_ADDR_IRQFLAGS1, HRF_MASK_MODEREADY | HRF_MASK_TXREADY, HRF_MASK_MODEREADY | HRF_MASK_TXREADY) != HRF_RESULT_OK)
+        radio_fault = true;
+}
+
+/*---------------------------------------------------------------------------*/
+// Microseconds since from (monotonic)
+
+static uint32_t _elapsed_us(const struct timespec *from)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((now.tv_sec - from->tv_sec) * 1000000L + (now.tv_nsec - from->tv_nsec) / 1000);
+}
+
+/*---------------------------------------------------------------------------*/
+// Record the receiver blind window, from the last packet leaving the FIFO to the receiver being ready again
+
+static void _record_blind(const struct timespec *sent)
+{
+    uint32_t us = _elapsed_us(sent);
+
+    tx_stats.blindCount++;
+    tx_stats.blindLastUs = us;
+    tx_stats.blindTotalUs += us;
+    if (us > tx_stats.blindMaxUs)
+        tx_stats.blindMaxUs = us;
+}
+
+/*---------------------------------------------------------------------------*/
+// Time on air for a number of frames of len bytes using the current modulation
+
+static uint32_t _airtime_us(uint8_t len, uint32_t frames)
+{
+    uint64_t bits;
+
+    if (radio_data.modu == RADIO_MODULATION_FSK)
+        bits = (uint64_t)frames * (RADIO_FSK_OVERHEAD * 8 + len * 16);
+    else
+        bits = (uint64_t)frames * len * 8;
+
+    return (uint32_t)(bits * 1000000 / RADIO_BITRATE);
+}
+
+/*---------------------------------------------------------------------------*/
+// Wait for the FIFO flags in IRQFLAGS2 to match, sleeping for the time the radio needs to send what we expect to
+// leave the FIFO rather than polling at a fixed interval.  Returns false if the flags did not change in time.
+
+static bool _wait_fifo(uint8_t mask, uint8_t value, uint32_t expect_us)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (expect_us > RADIO_TXPOLL_US)
+        delayus(expect_us - RADIO_TXPOLL_US);
+
+    while (!HRF_checkreg(HRF_ADDR_IRQFLAGS2, mask, value))
+    {
+        if (_elapsed_us(&start) > expect_us + RADIO_TXSLACK_US)
+        {
+            TRACE_FAIL("_wait_fifo(): FIFO did not drain\n");
+            radio_fault = true;
+            return false;
+        }
+        delayus(RADIO_TXPOLL_US);
+    }
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// Send payloads from FSK receive mode, using AutoModes for the last payload so that the radio drops into Tx when it
+// reaches the FIFO threshold and comes back to Standby by itself on PacketSent, then is put straight back into Rx.
+// No registers are reloaded, so the receiver is listening again as soon as the PLL has locked and we do not miss
+// replies sent straight after our command.
+//
+// The FIFO is only ever loaded in Standby with Standby as the AutoModes base mode: the FIFO is cleared on entering
+// Rx from Standby and on entering Tx from Rx, so a payload loaded around either transition could be lost or cut short.
+//
+// Any repeats before the last are streamed back to back from Tx as radio_send_payload(), there is only one Tx->Rx
+// turnaround however many times the payload is sent.
+
+static void _send_payload_automodes(uint8_t *payload, uint8_t len, uint8_t times)
+{
+    HRF_BATCH batch;
+    uint8_t fifo[HRF_MAX_FIFO + 1];
+    struct timespec start, sent;
+
+    if (times == 0 || len == 0 || len > 32)
+    {
+        TRACE_FAIL("radio_send_payload_automodes(): bad times or payloadlen\n");
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // stop receiving before the FIFO is loaded, throwing away anything partly received, so that no received bytes
+    // can be mixed into the payload
+    _change_mode(HRF_MODE_STANDBY);
+    HRF_clear_fifo();
+
+    if (times > 1)
+    {
+        _change_mode(HRF_MODE_TRANSMITTER);
+        radio_send_payload(payload, len, times - 1);
+        // the FIFO is empty, let the last byte leave the shift register before leaving Tx
+        delayus(RADIO_FSK_BYTE_US);
+        _change_mode(HRF_MODE_STANDBY);
+    }
+
+    // Set the AutoModes and load the last payload in Standby in one transaction.  FifoLevel triggers on strictly
+    // exceeding the threshold, so the radio enters Tx as the last byte is loaded.
+    fifo[0] = HRF_ADDR_FIFO | HRF_MASK_WRITE_DATA;
+    memcpy(&fifo[1], payload, len);
+    HRF_batch_init(&batch);
+    HRF_batch_writereg(&batch, HRF_ADDR_FIFOTHRESH, len - 1);
+    HRF_batch_writereg(&batch, HRF_ADDR_AUTOMODES, HRF_VAL_AUTOTX);
+    HRF_batch_burst(&batch, fifo, NULL, len + 1);
+    HRF_batch_submit(&batch);
+    leds_Tx();
+
+    // wait for the payload to leave the FIFO, then for PacketSent to take the radio back to Standby (TxReady falls)
+    sent = start;
+    if (_wait_fifo(HRF_MASK_FIFONOTEMPTY, 0, _airtime_us(len, 1)))
+    {
+        delayus(RADIO_FSK_BYTE_US);
+        if (HRF_pollreg(HRF_ADDR_IRQFLAGS1, HRF_MASK_MODEREADY | HRF_MASK_TXREADY, HRF_MASK_MODEREADY) != HRF_RESULT_OK)
+        {
+            TRACE_FAIL("radio_send_payload_automodes(): radio did not leave Tx\n");
+            radio_fault = true;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+    }
+
+    // back to Rx straight away
+    HRF_batch_init(&batch);
+    HRF_batch_writereg(&batch, HRF_ADDR_AUTOMODES, HRF_VAL_AUTOMODES_OFF);
+    HRF_batch_writereg(&batch, HRF_ADDR_OPMODE, HRF_MODE_RECEIVER);
+    HRF_batch_submit(&batch);
+    radio_data.mode = HRF_MODE_RECEIVER;
+    if (HRF_pollreg(HRF_ADDR_IRQFLAGS1, HRF_MASK_MODEREADY | HRF_MASK_RXREADY, HRF_MASK_MODEREADY | HRF_MASK_RXREADY) != HRF_RESULT_OK)
+    {
+        TRACE_FAIL("radio_send_payload_automodes(): radio did not return to Rx\n");
+        radio_fault = true;
+    }
+    leds_Rx();
+
+    tx_stats.lastAirtimeUs = _airtime_us(len, times);
+    tx_stats.lastTxUs = _elapsed_us(&start);
+
+    _record_blind(&sent);
+    tx_stats.autoModes++;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -194,6 +396,7 @@ void radio_reset(void)
 {
     // reset radio, flashing both LEDs to show reset
     leds_reset_board();
+    HRF_shadow_invalidate();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -209,7 +412,16 @@ int radio_init(void)
     if (ret == 0)
     {
         ret = leds_reset_board();
+        HRF_shadow_invalidate();
         if (ret == 0) {
+            // find the fastest SPI clock this board can use before talking to the radio (hardware SPI only)
+            delayms(RADIO_RESET_SETTLE_MS);
+            uint32_t hz = HRF_spi_calibrate();
+            if (hz != 0)
+            {
+                printf("ener314rt: Hardware SPI clock %u Hz\n", hz);
+            }
+
             TRACE_OUTS("radio_ver=");
             uint8_t rv = radio_get_ver();
             TRACE_OUTN(rv);
@@ -222,6 +434,15 @@ int radio_init(void)
                 TRACE_NL();
                 return ERR_RADIO_MIN;
             } else {
+                // Measure the SPI throughput, this is mainly of interest when using the software SPI driver
+                HRF_STATS spi;
+                int kbps = HRF_spi_selftest();
+                HRF_get_stats(&spi);
+                if (!spi.hwDriver)
+                {
+                    printf("ener314rt: Software SPI throughput %d kbit/s\n", kbps);
+                }
+
                 // Load shared registers
                 TRACE_OUTS("radio_init(): Loading Shared config\n");
                 _config(config_Shared,CONFIG_SHARED_COUNT);
@@ -320,7 +541,11 @@ void radio_transmit(uint8_t *payload, uint8_t len, uint8_t times)
 }
 
 /*---------------------------------------------------------------------------*/
-// Send a payload of data
+// Send a payload of data, repeated times back to back
+//
+// The payloads are streamed through the FIFO: as many whole payloads as fit are loaded in one burst, then the FIFO
+// is topped up a payload at a time whenever there is room, so the radio never runs dry between repeats.  Waits are
+// based on the airtime of what is queued in the FIFO instead of a fixed poll interval.
 
 void radio_send_payload(uint8_t *payload, uint8_t len, uint8_t times)
 {
@@ -334,49 +559,46 @@ void radio_send_payload(uint8_t *payload, uint8_t len, uint8_t times)
     // Also need to confirm this bit only occurs when transmit actually starts,
     // and not on every FIFO load.
 
-    int i;
+    uint8_t burst[MAX_FIFO_BUFFER];
+    uint8_t perburst, loaded, queued, i;
+    struct timespec start;
 
     /* VALIDATE: Check input parameters are in range */
-    if (times == 0 || len == 0) //TODO: make this an ASSERT()
+    if (times == 0 || len == 0 || len > 32) //TODO: make this an ASSERT()
     {
-        TRACE_FAIL("zero times or payloadlen\n");
-    }
-    if (len > 32) //TODO: make this an ASSERT()
-    {
-        TRACE_FAIL("payload length>32\n");
+        TRACE_FAIL("bad times or payloadlen\n");
+        return;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     /* CONFIGURE: Setup the radio for transmit of the correct payload length */
-    // TRACE_OUTS("config\n");
-    // Start transmitting when a full payload is loaded. So for '15':
-    // level triggers when it 'strictly exceeds' level (i.e. 16 bytes starts tx,
-    // and <=15 bytes triggers fifolevel irqflag to be cleared)
-    // We already know from earlier that payloadlen<=32 (which fits into half a FIFO)
-    HRF_writereg(HRF_ADDR_FIFOTHRESH, len - 1);
+    // Start transmitting as soon as the FIFO is not empty; the whole of the first burst is loaded long before the
+    // first byte has been sent.  The threshold is set so that FifoLevel clears when there is room for another
+    // payload (it triggers when the level 'strictly exceeds' the threshold)
+    HRF_writereg(HRF_ADDR_FIFOTHRESH, HRF_MASK_TXSTARTNOTEMPTY | (MAX_FIFO_BUFFER - len));
 
     /* TRANSMIT: Transmit a number of payloads back to back */
     TRACE_OUTN(times);
     TRACE_OUTS(" tx payloads\n");
-    /*
-#if defined(TRACE)
-    for (i = 0; i < len; i++)
-    {
-        TRACE_OUTN(payload[i]);
-        TRACE_OUTC(',');
-    }
-    TRACE_NL();
-#endif
-*/
 
-    // send a number of payload repeats for the whole packet burst
-    for (i = 0; i < times; i++)
+    // first burst, pack as many whole payloads as will fit into the FIFO (4 OOK frames)
+    perburst = MAX_FIFO_BUFFER / len;
+    loaded = (times < perburst) ? times : perburst;
+    for (i = 0; i < loaded; i++)
+        memcpy(&burst[i * len], payload, len);
+    HRF_writefifo_burst(burst, loaded * len);
+    queued = loaded;
+
+    // top up the FIFO a payload at a time as the radio makes room
+    while (loaded < times)
     {
+        // room appears once the bytes above the threshold have been sent
+        if (!_wait_fifo(HRF_MASK_FIFOLEVEL, 0, _airtime_us(len, queued - (perburst - 1))))
+            break;
         HRF_writefifo_burst(payload, len);
-        // Tx will auto start when fifolevel is exceeded by loading the payload
-        // so the level register must be correct for the size of the payload
-        // otherwise transmit will never start.
-        /* wait for FIFO to not exceed threshold level */
-        HRF_pollreg(HRF_ADDR_IRQFLAGS2, HRF_MASK_FIFOLEVEL, 0);
+        loaded++;
+        queued = perburst;
         #if defined(FULLTRACE)
             TRACE_OUTC('X');
         #endif
@@ -387,13 +609,21 @@ void radio_send_payload(uint8_t *payload, uint8_t len, uint8_t times)
     #endif
 
     // wait for FIFO empty, to indicate transmission completed
-    HRF_pollreg(HRF_ADDR_IRQFLAGS2, HRF_MASK_FIFONOTEMPTY, 0);
+    _wait_fifo(HRF_MASK_FIFONOTEMPTY, 0, _airtime_us(len, queued));
+
+    tx_stats.lastAirtimeUs = _airtime_us(len, times);
+    tx_stats.lastTxUs = _elapsed_us(&start);
 
     /* CONFIRM: Was the transmit ok? */
     // Check final flags in case of overruns etc
     #if defined(FULLTRACE)
-        uint8_t irqflags1 = HRF_readreg(HRF_ADDR_IRQFLAGS1);
-        uint8_t irqflags2 = HRF_readreg(HRF_ADDR_IRQFLAGS2);
+        HRF_BATCH batch;
+        HRF_batch_init(&batch);
+        int op1 = HRF_batch_readreg(&batch, HRF_ADDR_IRQFLAGS1);
+        int op2 = HRF_batch_readreg(&batch, HRF_ADDR_IRQFLAGS2);
+        HRF_batch_submit(&batch);
+        uint8_t irqflags1 = HRF_batch_result(&batch, op1);
+        uint8_t irqflags2 = HRF_batch_result(&batch, op2);
         TRACE_OUTS("irqflags1,2=");
         TRACE_OUTN(irqflags1);
         TRACE_OUTC(',');
@@ -425,6 +655,105 @@ bool radio_is_receive_waiting(void)
 */
 }
 
+/*---------------------------------------------------------------------------*/
+// Check to see if a payload is waiting and read its signal quality, in one transaction.  This needs to be done
+// before the payload is read as the receiver restarts once the FIFO has been emptied.
+// RSSI is in dBm, AFC (the correction applied by the radio) and FEI (the frequency error measured) are in Hz.
+// AFCMSB..RSSIVALUE are consecutive so they are a single burst.
+
+RADIO_RESULT radio_get_rx_status(RADIO_RX_STATUS *status)
+{
+    HRF_BATCH batch;
+    uint8_t tx[HRF_ADDR_RSSIVALUE - HRF_ADDR_AFCMSB + 2] = {HRF_ADDR_AFCMSB};
+    uint8_t regs[HRF_ADDR_RSSIVALUE - HRF_ADDR_AFCMSB + 2] = {0};
+    int op;
+
+    HRF_batch_init(&batch);
+    op = HRF_batch_readreg(&batch, HRF_ADDR_IRQFLAGS2);
+    HRF_batch_burst(&batch, tx, regs, sizeof(regs));
+    if (HRF_batch_submit(&batch) != HRF_RESULT_OK)
+    {
+        status->waiting = false;
+        return RADIO_RESULT_ERR_READ_FAILED;
+    }
+
+    // regs[0] is clocked in whilst the address is sent
+    status->waiting = (HRF_batch_result(&batch, op) & HRF_MASK_PAYLOADRDY) == HRF_MASK_PAYLOADRDY;
+    status->afc = (int32_t)(int16_t)((regs[1] << 8) | regs[2]) * HRF_FSTEP_HZ;
+    status->fei = (int32_t)(int16_t)((regs[3] << 8) | regs[4]) * HRF_FSTEP_HZ;
+    status->rssi = -(float)regs[HRF_ADDR_RSSIVALUE - HRF_ADDR_AFCMSB + 1] / 2;
+
+    return RADIO_RESULT_OK;
+}
+
+/*---------------------------------------------------------------------------*/
+// Receive the packet waiting in the FIFO along with its signal quality.
+//
+// The length byte is not known until it has been read, so rather than reading it first the whole FIFO is read in
+// the same operation as the payload; only one packet is held at a time and the receiver does not restart until the
+// FIFO is empty, so this reads the packet plus unused bytes and always leaves the FIFO empty.  When the caller has
+// just consumed a DIO0 edge (irq) and DIO0 is still high this is added to the status transaction, so a packet takes a
+// single transaction.  DIO0 alone is not trusted as the line may be unwired or floating, and reading the FIFO before
+// PayloadReady would throw away a packet that is still arriving.
+//
+// On return buf[0] holds the payload length followed by the payload, or 0 if the packet could not be an
+// OpenThings message (or did not fit buf) and was discarded.
+
+RADIO_RESULT radio_get_rx_packet(RADIO_RX_STATUS *status, uint8_t *buf, uint8_t buflen, bool irq)
+{
+    static uint8_t fifo_tx[HRF_MAX_FIFO + 1] = {HRF_ADDR_FIFO};
+    uint8_t fifo_rx[HRF_MAX_FIFO + 1];
+    uint8_t tx[HRF_ADDR_RSSIVALUE - HRF_ADDR_AFCMSB + 2] = {HRF_ADDR_AFCMSB};
+    uint8_t regs[HRF_ADDR_RSSIVALUE - HRF_ADDR_AFCMSB + 2] = {0};
+    HRF_BATCH batch;
+    bool ready;
+    uint8_t len;
+    int op;
+
+    buf[0] = 0;
+    ready = irq && (leds_rx_irq_level() == 1);
+
+    HRF_batch_init(&batch);
+    op = HRF_batch_readreg(&batch, HRF_ADDR_IRQFLAGS2);
+    HRF_batch_burst(&batch, tx, regs, sizeof(regs));
+    if (ready)
+        HRF_batch_burst(&batch, fifo_tx, fifo_rx, sizeof(fifo_rx));
+    if (HRF_batch_submit(&batch) != HRF_RESULT_OK)
+    {
+        status->waiting = false;
+        return RADIO_RESULT_ERR_READ_FAILED;
+    }
+
+    status->waiting = (HRF_batch_result(&batch, op) & HRF_MASK_PAYLOADRDY) == HRF_MASK_PAYLOADRDY;
+    status->afc = (int32_t)(int16_t)((regs[1] << 8) | regs[2]) * HRF_FSTEP_HZ;
+    status->fei = (int32_t)(int16_t)((regs[3] << 8) | regs[4]) * HRF_FSTEP_HZ;
+    status->rssi = -(float)regs[HRF_ADDR_RSSIVALUE - HRF_ADDR_AFCMSB + 1] / 2;
+
+    if (!status->waiting)
+        return RADIO_RESULT_OK;
+
+    if (!ready)
+    {
+        // no DIO0 edge, the FIFO is read now that we know there is a payload
+        HRF_batch_burst(&batch, fifo_tx, fifo_rx, sizeof(fifo_rx));
+        if (HRF_batch_submit(&batch) != HRF_RESULT_OK)
+            return RADIO_RESULT_ERR_READ_FAILED;
+    }
+
+    // fifo_rx[0] is clocked in whilst the address is sent, then the count byte and payload
+    len = fifo_rx[1];
+    if (len > 5 && len < buflen && len < HRF_MAX_FIFO)
+    {
+        memcpy(buf, &fifo_rx[1], len + 1);
+    }
+    else
+    {
+        TRACE_OUTS("radio_get_rx_packet(): Non-OT payload discarded\n");
+    }
+
+    return RADIO_RESULT_OK;
+}
+
 /*---------------------------------------------------------------------------*/
 // read a single payload from the payload buffer
 // this reads a fixed length payload
@@ -479,6 +808,7 @@ void radio_finished(void)
     //spi_finished();
     radio_standby();
     leds_reset_board();
+    HRF_shadow_invalidate();
     leds_close();
 
     // clear globals
@@ -540,6 +870,9 @@ void radio_setmode(RADIO_MODULATION mod, RADIO_MODE mode)
 **
 ** Please ensure that the radio device is mutex locked in multithreaded environment before calling
 **
+** When monitoring FSK the transmit uses AutoModes so the radio leaves Tx by itself on PacketSent and is put straight
+** back into receive without reloading config_FSK, the time taken to get back to receive is recorded in the tx stats
+**
 ** @Achronite - March 2019
 **/
 
@@ -549,15 +882,27 @@ void radio_mod_transmit(RADIO_MODULATION mod, uint8_t *payload, uint8_t len, uin
         TRACE_OUTS("radio_mod_transmit()\n");
     #endif
 
+    struct timespec sent;
+
     // preserve previous mode & modulation
     uint8_t prevmod = radio_data.modu;
     uint8_t prevmode = radio_data.mode;
 
-    if (prevmode != HRF_MODE_TRANSMITTER || prevmod != mod)
+    tx_stats.count++;
+
+    if (mod == RADIO_MODULATION_FSK && prevmod == RADIO_MODULATION_FSK && prevmode == HRF_MODE_RECEIVER)
+    {
+        // monitoring FSK, let the radio return to receive by itself
+        _send_payload_automodes(payload, len, times);
+    }
+    else if (prevmode != HRF_MODE_TRANSMITTER || prevmod != mod)
     {
         radio_setmode(mod, HRF_MODE_TRANSMITTER);
         radio_send_payload(payload, len, times);
+        clock_gettime(CLOCK_MONOTONIC, &sent);
         radio_setmode(prevmod, prevmode);
+        if (prevmode == HRF_MODE_RECEIVER)
+            _record_blind(&sent);
     }
     else
     {
@@ -568,4 +913,97 @@ void radio_mod_transmit(RADIO_MODULATION mod, uint8_t *payload, uint8_t len, uin
         radio_standby();
     }
 }
+
+/* radio_check_health()
+**
+** Check that the radio is still answering as configured: the version register reads back correctly, it is in the
+** mode we last put it in, and that mode is ready.  A radio that has reset itself (brown out) comes back in standby,
+** a wedged radio or SPI bus reads back as all 0s or all 1s.  Any poll that timed out since the last recovery also
+** counts as a failure.
+**
+** returns true if healthy
+*/
+bool radio_check_health(void)
+{
+    HRF_BATCH batch;
+    uint8_t ver, opmode, irqflags1;
+    int op1, op2, op3;
+
+    if (radio_fault)
+        return false;
+
+    HRF_batch_init(&batch);
+    op1 = HRF_batch_readreg(&batch, HRF_ADDR_VERSION);
+    op2 = HRF_batch_readreg(&batch, HRF_ADDR_OPMODE);
+    op3 = HRF_batch_readreg(&batch, HRF_ADDR_IRQFLAGS1);
+    if (HRF_batch_submit(&batch) != HRF_RESULT_OK)
+        return false;
+    ver = HRF_batch_result(&batch, op1);
+    opmode = HRF_batch_result(&batch, op2);
+    irqflags1 = HRF_batch_result(&batch, op3);
+
+    if (ver != EXPECTED_RADIOVER)
+    {
+        TRACE_FAIL("radio_check_health(): bad version\n");
+        return false;
+    }
+    if (radio_data.mode != RADIO_UNKNOWN && (opmode & HRF_MASK_MODE) != radio_data.mode)
+    {
+        TRACE_FAIL("radio_check_health(): unexpected mode\n");
+        return false;
+    }
+    if ((irqflags1 & HRF_MASK_MODEREADY) == 0)
+    {
+        TRACE_FAIL("radio_check_health(): mode not ready\n");
+        return false;
+    }
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// A poll or wait has timed out since the last recovery
+
+bool radio_faulted(void)
+{
+    return radio_fault;
+}
+
+/* radio_recover()
+**
+** Reset the radio and reload its configuration from the HRF shadow copy of everything we have written, then put it
+** back into the mode it was in.  Registers that were never written come back at their reset defaults.
+**
+** returns 0 on success, or ERR_RADIO_MIN if the radio did not come back
+*/
+int radio_recover(void)
+{
+    RADIO_MODE mode = radio_data.mode;
+
+    TRACE_OUTS("radio_recover()\n");
+
+    radio_fault = false;
+    leds_reset_board();
+    delayms(RADIO_RESET_SETTLE_MS);
+
+    if (radio_get_ver() != EXPECTED_RADIOVER)
+    {
+        radio_fault = true;
+        return ERR_RADIO_MIN;
+    }
+
+    // the radio is in standby with its reset defaults, so rewrite everything the shadow copy holds
+    HRF_shadow_restore();
+    radio_data.mode = HRF_MODE_STANDBY;
+    if (mode != RADIO_UNKNOWN && mode != HRF_MODE_STANDBY)
+        _change_mode(mode);
+
+    return radio_fault ? ERR_RADIO_MIN : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void radio_get_tx_stats(RADIO_TX_STATS *stats)
+{
+    *stats = tx_stats;
+}
 /***** END OF FILE *****/
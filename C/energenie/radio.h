@@ -9,6 +9,7 @@
 
 #include "system.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef uint8_t RADIO_RESULT;
 #define RADIO_RESULT_IS_ERR(R)         (((R) & 0x80) != 0)
@@ -31,6 +32,28 @@ typedef uint8_t RADIO_MODE;
 #define ERR_RADIO_MAX -4
 #define ERR_SPI_ROOT  -5
 
+// transmit counters, including the receiver 'blind window' between a packet being sent and the receiver being ready
+typedef struct
+{
+    uint32_t count;             // transmits
+    uint32_t autoModes;         // transmits that returned to receive using AutoModes
+    uint32_t blindCount;        // transmits that returned to receive afterwards
+    uint32_t blindLastUs;
+    uint32_t blindMaxUs;
+    uint64_t blindTotalUs;
+    uint32_t lastAirtimeUs;     // theoretical airtime of the last transmit (all repeats)
+    uint32_t lastTxUs;          // time actually taken to send it
+} RADIO_TX_STATS;
+
+// receive status, with the signal quality of the payload waiting
+typedef struct
+{
+    bool waiting;               // payload ready
+    float rssi;                 // dBm
+    int32_t afc;                // Hz
+    int32_t fei;                // Hz
+} RADIO_RX_STATUS;
+
 //extern void radio_init(void);
 void radio_reset(void);
 int radio_init(void);
@@ -42,11 +65,17 @@ void radio_standby(void);
 void radio_transmit(uint8_t* payload, uint8_t len, uint8_t times);
 void radio_send_payload(uint8_t* payload, uint8_t len, uint8_t times);
 bool radio_is_receive_waiting(void);
+RADIO_RESULT radio_get_rx_status(RADIO_RX_STATUS* status);
+RADIO_RESULT radio_get_rx_packet(RADIO_RX_STATUS* status, uint8_t* buf, uint8_t buflen, bool irq);
 //unused RADIO_RESULT radio_get_payload_len(uint8_t* buf, uint8_t buflen);
 RADIO_RESULT radio_get_payload_cbp(uint8_t* buf, uint8_t buflen);
 void radio_finished(void);
 void radio_setmode(RADIO_MODULATION mod, RADIO_MODE mode);
 void radio_mod_transmit(RADIO_MODULATION mod, uint8_t* payload, uint8_t len, uint8_t times);
+void radio_get_tx_stats(RADIO_TX_STATS* stats);
+bool radio_check_health(void);
+bool radio_faulted(void);
+int radio_recover(void);
 
 #endif
 
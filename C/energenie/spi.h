@@ -38,9 +38,9 @@ typedef struct
   //struct timespec tSettle;
   //struct timespec tHold;
   //struct timespec tFreq;
-  unsigned int tSettle;
-  unsigned int tHold;
-  unsigned int tFreq;
+  unsigned int tSettle;   // ns
+  unsigned int tHold;     // ns
+  unsigned int tFreq;     // ns, half clock
 } SPI_CONFIG;
 
 
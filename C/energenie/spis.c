@@ -17,7 +17,6 @@
 
 /***** MACROS *****/
 
-#define CLOCK_ACTIVE() gpio_write(config.sclk, config.cpol ? 0 : 1)
 #define CLOCK_IDLE() gpio_write(config.sclk, config.cpol ? 1 : 0)
 
 #define SELECTED() gpio_write(config.cs, config.spol ? 1 : 0)
@@ -27,6 +26,11 @@
 
 static SPI_CONFIG config;
 
+// pin masks for gpio_set_clear(), so a clock edge and the next data bit can be written together
+static uint32_t mosi_mask;
+static uint32_t idle_set;   // clock to idle
+static uint32_t idle_clr;
+
 int spi_init_defaults(void)
 {
 #define CS 7 //CE1
@@ -34,10 +38,10 @@ int spi_init_defaults(void)
 #define MOSI 10
 #define MISO 9
 
-/* ms */
-#define TSETTLE (1) /* us settle */
-#define THOLD (1)   /* us hold */
-#define TFREQ (1)   /* us half clock */
+/* ns, the RFM69 needs at least 50ns each side of the clock (10MHz) */
+#define TSETTLE (100) /* ns settle */
+#define THOLD (0)     /* ns hold */
+#define TFREQ (100)   /* ns half clock */
 
   SPI_CONFIG defaultConfig = {CS, SCLK, MOSI, MISO, SPI_SPOL0, SPI_CPOL0, SPI_CPHA0,
                               TSETTLE, THOLD, TFREQ};
@@ -56,6 +60,10 @@ int spi_init(SPI_CONFIG *pConfig)
       return ERR_CPHA1;
     }
 
+    mosi_mask = 1UL << config.mosi;
+    idle_set = config.cpol ? (1UL << config.sclk) : 0;
+    idle_clr = config.cpol ? 0 : (1UL << config.sclk);
+
     gpio_setout(config.sclk);
     CLOCK_IDLE();
 
@@ -78,40 +86,53 @@ void spi_finished(void)
 void spi_select(void)
 {
   SELECTED();
-  delayus(config.tSettle);
+  delayns(config.tSettle);
 }
 
 void spi_deselect(void)
 {
   NOT_SELECTED();
-  delayus(config.tSettle);
+  delayns(config.tSettle);
 }
 
+/* The clock returning to idle and the next data bit are written in the same pair of set/clear register writes,
+ * so each bit costs three GPIO writes and a read, plus the configured delays.
+ */
+
 uint8_t spi_byte(uint8_t txbyte)
 {
   uint8_t rxbyte = 0;
   uint8_t bitno;
-  uint8_t bit;
+  uint32_t set;
+  uint32_t clr;
 
   //TODO: Implement CPHA1
 
+  /* Transmit MSB first, clock is idle */
+  gpio_set_clear((txbyte & 0x80) ? mosi_mask : 0, (txbyte & 0x80) ? 0 : mosi_mask);
+
   for (bitno = 0; bitno < 8; bitno++)
   {
-    /* Transmit MSB first */
-    bit = ((txbyte & 0x80) != 0x00);
-    txbyte <<= 1;
-    gpio_write(config.mosi, bit);
-    delayus(config.tSettle);
-    CLOCK_ACTIVE();
-    delayus(config.tHold);
-    delayus(config.tFreq);
+    delayns(config.tSettle);
+    gpio_set_clear(idle_clr, idle_set);     /* clock active */
+    delayns(config.tHold + config.tFreq);
 
     /* Read MSB first */
-    bit = gpio_read(config.miso);
-    rxbyte = (rxbyte << 1) | bit;
+    rxbyte = (rxbyte << 1) | gpio_read(config.miso);
 
-    CLOCK_IDLE();
-    delayus(config.tFreq);
+    /* clock idle, and set up the next bit */
+    txbyte <<= 1;
+    set = idle_set;
+    clr = idle_clr;
+    if (bitno < 7)
+    {
+      if (txbyte & 0x80)
+        set |= mosi_mask;
+      else
+        clr |= mosi_mask;
+    }
+    gpio_set_clear(set, clr);
+    delayns(config.tFreq);
   }
   return rxbyte;
 }
@@ -93,12 +93,12 @@ function getMonitorMsg() {
 
 // monitor thread version in ener314rt uses a callback to return monitor messages directly (collected below), it needs the callback passing in
 function startMonitoringThread() {
-    ener314rt.openThingsReceiveThread(10000, (msg) => {
+    // messages are delivered as objects (objects=true), so there is no need to JSON.parse() them
+    ener314rt.openThingsReceiveThread(10000, (OTmsg) => {
         //console.log(`asyncOpenThingsReceive ret=${ret}`);
-        console.log(`child: received=${msg}`);
-        var OTmsg = JSON.parse(msg);
-            process.send(OTmsg);
-    });
+        console.log(`child: received deviceId=${OTmsg.deviceId}`);
+        process.send(OTmsg);
+    }, 1, 50, true);
 };
 
 // Initialise
@@ -7,6 +7,8 @@
           "C/achronite/napi_energenie.c",
           "C/achronite/napi_energenie.c",
           "C/achronite/lock_radio.c",
+          "C/achronite/rx_ring.c",
+          "C/achronite/json_writer.c",
           "C/achronite/ook_send.c",
           "C/achronite/openThings.c",
           "C/energenie/radio.c",
@@ -6,10 +6,21 @@ module.exports.initEner314rt           = addon.initEner314rt;           // Initi
 module.exports.openThingsSwitch        = addon.openThingsSwitch;        // Switch an FSK device
 module.exports.openThingsDeviceList    = addon.openThingsDeviceList;    // List discovered devices
 module.exports.openThingsReceive       = addon.openThingsReceive;       // Get single message
+module.exports.openThingsReceiveAsync  = addon.openThingsReceiveAsync;  // Get single message (timeout, signal), returns a Promise
 module.exports.openThingsReceiveThread = addon.openThingsReceiveThread; // Start Receive Thread
 module.exports.openThingsCmd           = addon.openThingsCmd;           // Send a Command immediately to FSK device
 module.exports.openThingsCacheCmd      = addon.openThingsCacheCmd;      // Cache an eTRV Command
 module.exports.stopMonitoring          = addon.stopMonitoring;          // Stop Receive Thread
+module.exports.setMonitorQueue         = addon.setMonitorQueue;         // Bound the monitor delivery queue (size, policy: 0=block, 1=drop oldest, 2=coalesce per device)
+module.exports.getMonitorStats         = addon.getMonitorStats;         // Monitor delivery queue counters (json)
 module.exports.ookSwitch               = addon.ookSwitch;               // Switch an OOK device (zone, switchNum, switchState, xmits)
 module.exports.sendRadioMsg            = addon.sendRadioMsg;            // Send raw payload(modulation, xmits, buffer)
-module.exports.closeEner314rt          = addon.closeEner314rt;          // Stop using the radio adaptor
\ No newline at end of file
+module.exports.ookSwitchAsync          = addon.ookSwitchAsync;          // As ookSwitch, returns a Promise of {result, airtimeUs, txUs, txMonoUs}
+module.exports.openThingsSwitchAsync   = addon.openThingsSwitchAsync;   // As openThingsSwitch, returns a Promise
+module.exports.openThingsCmdAsync      = addon.openThingsCmdAsync;      // As openThingsCmd, returns a Promise
+module.exports.sendRadioMsgAsync       = addon.sendRadioMsgAsync;       // As sendRadioMsg, returns a Promise
+module.exports.closeEner314rt          = addon.closeEner314rt;          // Stop using the radio adaptor
+module.exports.setRxBuffer             = addon.setRxBuffer;             // Size receive buffer & drop policy (size, dropPolicy) - call before init
+module.exports.setRadioThread          = addon.setRadioThread;          // Real-time scheduling for the radio thread (priority, cpuMask, lockMemory)
+module.exports.setLeds                 = addon.setLeds;                 // Switch the Tx/Rx LEDs on or off (enabled)
+module.exports.getRadioStats           = addon.getRadioStats;           // Radio counters (json)
\ No newline at end of file